@@ -0,0 +1,123 @@
+#! /usr/bin/env python
+# -*- coding: utf-8 -*-
+
+"""
+Check that Connection.callmany() pays one server round trip per batch.
+
+The TDS 7.0 stand-in server from packetsize_benchmark.py answers each batch
+of calls with a result set per call standing in for the procedure's own rows,
+which callmany() has to skip, followed by the call's return status and output
+values. It counts the requests it receives, so calls sent one at a time, or
+sent as separate RPC requests, fail the check.
+"""
+
+from __future__ import print_function
+
+from optparse import OptionParser
+from os import environ, remove
+from re import compile
+from struct import pack
+from time import time
+
+import bcp
+
+from packetsize_benchmark import StandInServer, StandInSession, b_varchar, write_freetds_conf
+
+CALL_SELECT = compile(r"select @bcp_status_\d+ as bcp_call_(\d+)([^;]*);")
+
+class ApplicationOptions(OptionParser, object):
+    def __init__(self):
+        super(ApplicationOptions, self).__init__()
+
+        self.add_option(
+            "--calls",
+            dest="calls",
+            type="int",
+            help="Procedure calls to make",
+            default=10000,
+        )
+
+        self.add_option(
+            "--batchsize",
+            dest="batchsize",
+            type="int",
+            help="Calls per batch",
+            default=1000,
+        )
+
+class CallmanySession(StandInSession):
+    """ Answer batches of procedure calls, counting the requests """
+
+    requests = []
+    calls = 0
+
+    def result_set(self, names, values):
+        metadata = pack("<BH", 0x81, len(names)) + b"".join(pack("<HHB", 0, 0x0009, 0x38) + b_varchar(name) for name in names)
+        row = pack("<B", 0xD1) + b"".join(pack("<i", value) for value in values)
+        return metadata + row + self.done(0x0011, 1)
+
+    def batch_response(self, query):
+        selects = CALL_SELECT.findall(query)
+
+        if not selects:
+            return super(CallmanySession, self).batch_response(query)
+
+        CallmanySession.requests.append(len(selects))
+        tokens = []
+
+        for call, outputs in selects:
+            value = CallmanySession.calls
+            columns = 1 + outputs.count("@bcp_output")
+            CallmanySession.calls += 1
+
+            tokens.append(self.result_set(["procedure_rows"], [-1]))
+            tokens.append(self.result_set(["bcp_call_" + call] + [""] * (columns - 1), [value] * columns))
+
+        return b"".join(tokens) + self.done()
+
+def main(argv):
+    (options, args) = ApplicationOptions().parse_args(argv)
+
+    server = StandInServer(32767, CallmanySession)
+    server.start()
+
+    conf_file = write_freetds_conf(server.port)
+    environ["FREETDSCONF"] = conf_file
+
+    try:
+        bcp_connection = bcp.Connection(server="standin", username="check", password="check", database="check")
+
+        rows = [(index, None) for index in range(options.calls)]
+        started = time()
+        statuses, outputs, errors = bcp_connection.callmany("usp_check", rows, outputs={1: "int"}, batchsize=options.batchsize)
+        elapsed = time() - started
+
+        bcp_connection.disconnect()
+    finally:
+        remove(conf_file)
+
+    expected = (options.calls + options.batchsize - 1) // options.batchsize
+
+    print("%-10s %-10s %-12s %12s" % ("calls", "batchsize", "round trips", "seconds"))
+    print("%-10d %-10d %-12d %12.3f" % (options.calls, options.batchsize, len(CallmanySession.requests), elapsed))
+
+    if len(CallmanySession.requests) != expected:
+        raise AssertionError("expected %d round trips, the server saw %d" % (expected, len(CallmanySession.requests)))
+
+    if statuses != list(range(options.calls)) or outputs != [(status,) for status in statuses]:
+        raise AssertionError("return statuses or output values don't match their calls")
+
+    if any(errors):
+        raise AssertionError("calls reported errors: %r" % [error for error in errors if error][:3])
+
+if __name__ == "__main__":
+    from sys import exit, argv, stderr
+
+    try:
+        main(argv[1:])
+    except AssertionError as error:
+        print("FAILED: %s" % error, file=stderr)
+        exit(1)
+    except KeyboardInterrupt:
+        print("Exiting due to <ctrl-c>", file=stderr)
+        exit(0)
@@ -0,0 +1,81 @@
+#! /usr/bin/env python
+# -*- coding: utf-8 -*-
+
+"""
+Check that str values sent to an nvarchar column reach the server as the
+UTF-16LE it stores, converted once by FreeTDS from the UTF-8 client charset.
+
+The TDS 7.0 stand-in server from packetsize_benchmark.py describes the target
+table as a single nvarchar column and keeps the bulk load payloads it receives.
+The check fails unless every value's UTF-16LE encoding is in them, which rules
+out text passed through a single byte code page or converted twice.
+"""
+
+from __future__ import print_function
+
+from os import environ, remove
+from struct import pack
+
+import bcp
+
+from packetsize_benchmark import StandInServer, StandInSession, b_varchar, write_freetds_conf
+
+VALUES = [
+    u"plain ascii",
+    u"Grüße aus Köln",
+    u"Ελληνικά",
+    u"東京都千代田区",
+]
+
+class NationalSession(StandInSession):
+    """ Describe an nvarchar(200) table and keep what is bulk loaded into it """
+
+    payloads = []
+
+    def column_metadata(self):
+        collation = b"\x09\x04\xd0\x00\x34" if self.tds71 else b""
+        return pack("<BH", 0x81, 1) + pack("<HHB", 0, 0x0009, 0xE7) + pack("<H", 400) + collation + b_varchar(u"name")
+
+    def bulk_response(self, payload):
+        NationalSession.payloads.append(payload)
+        return super(NationalSession, self).bulk_response(payload)
+
+def main(argv):
+    server = StandInServer(32767, NationalSession)
+    server.start()
+
+    conf_file = write_freetds_conf(server.port)
+    environ["FREETDSCONF"] = conf_file
+
+    try:
+        bcp_connection = bcp.Connection(server="standin", username="check", password="check", database="check")
+        bcp_connection.init("national_table")
+
+        for value in VALUES:
+            bcp_connection.send([value])
+
+        bcp_connection.done()
+        bcp_connection.disconnect()
+    finally:
+        remove(conf_file)
+
+    payload = b"".join(NationalSession.payloads)
+
+    for value in VALUES:
+        found = value.encode("utf-16-le") in payload
+        print("%-6s %s" % ("ok" if found else "FAILED", repr(value)))
+
+        if not found:
+            raise AssertionError("%r didn't reach the server as UTF-16LE" % value)
+
+if __name__ == "__main__":
+    from sys import exit, argv, stderr
+
+    try:
+        main(argv[1:])
+    except AssertionError as error:
+        print("FAILED: %s" % error, file=stderr)
+        exit(1)
+    except KeyboardInterrupt:
+        print("Exiting due to <ctrl-c>", file=stderr)
+        exit(0)
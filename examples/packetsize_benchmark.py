@@ -0,0 +1,271 @@
+#! /usr/bin/env python
+# -*- coding: utf-8 -*-
+
+"""
+Measure bulk copy throughput for a range of TDS packet sizes.
+
+A minimal TDS 7.0 stand-in server is started on the loopback interface. It
+accepts the login, answers the metadata query issued by bcp_init() and
+acknowledges bulk load batches without storing anything, so the numbers
+reflect client side packet handling rather than server insert speed.
+"""
+
+from __future__ import print_function
+
+from optparse import OptionParser
+from os import environ, remove
+from socket import socket, AF_INET, SOCK_STREAM, SOL_SOCKET, SO_REUSEADDR
+from struct import pack, unpack
+from tempfile import mkstemp
+from threading import Thread
+from time import time
+
+import os
+
+import bcp
+
+TDS_SQL_BATCH = 0x01
+TDS_REPLY = 0x04
+TDS_BULK = 0x07
+TDS_LOGIN7 = 0x10
+TDS_PRELOGIN = 0x12
+
+TABLE_COLUMNS = [
+    # name, TDS type token, type definition
+    ("name", 0xA7, pack("<H", 256)),  # BIGVARCHAR
+    ("age", 0x38, b""),               # INT4
+    ("score", 0x3E, b""),             # FLT8
+]
+
+class ApplicationOptions(OptionParser, object):
+    def __init__(self):
+        super(ApplicationOptions, self).__init__()
+
+        self.add_option(
+            "--rows",
+            dest="rows",
+            type="int",
+            help="Rows to send for each packet size",
+            default=200000,
+        )
+
+        self.add_option(
+            "--batchsize",
+            dest="batchsize",
+            type="int",
+            help="Rows per bcp_batch",
+            default=10000,
+        )
+
+        self.add_option(
+            "--server-max",
+            dest="server_max",
+            type="int",
+            help="Largest packet size the stand-in server will grant",
+            default=32767,
+        )
+
+        self.add_option(
+            "--sizes",
+            dest="sizes",
+            help="Comma separated packet sizes to measure ('auto' is allowed)",
+            default="512,4096,8192,16384,32767,auto",
+        )
+
+def ucs2(text):
+    return text.encode("utf-16-le")
+
+def b_varchar(text):
+    return pack("<B", len(text)) + ucs2(text)
+
+class StandInSession(Thread):
+    """ Serve a single client connection """
+
+    def __init__(self, connection, server_max):
+        super(StandInSession, self).__init__()
+        self.daemon = True
+        self.connection = connection
+        self.server_max = server_max
+        self.packetsize = 4096
+        self.tds71 = False
+
+    def receive_exactly(self, size):
+        chunks = []
+
+        while size > 0:
+            chunk = self.connection.recv(size)
+
+            if not chunk:
+                raise EOFError()
+
+            chunks.append(chunk)
+            size -= len(chunk)
+
+        return b"".join(chunks)
+
+    def receive_message(self):
+        """ Collect packets up to and including the end of message flag """
+        payload = []
+
+        while True:
+            header = self.receive_exactly(8)
+            packet_type, status, length = unpack(">BBH", header[:4])
+            payload.append(self.receive_exactly(length - 8))
+
+            if status & 0x01:
+                return packet_type, b"".join(payload)
+
+    def send_message(self, packet_type, payload):
+        chunk_size = self.packetsize - 8
+        offsets = list(range(0, len(payload), chunk_size)) or [0]
+
+        for packet_id, offset in enumerate(offsets):
+            chunk = payload[offset:offset + chunk_size]
+            status = 0x01 if offset == offsets[-1] else 0x00
+            self.connection.sendall(pack(">BBHHBB", packet_type, status, len(chunk) + 8, 0, (packet_id + 1) % 256, 0) + chunk)
+
+    def done(self, status=0x0000, rowcount=0):
+        return pack("<BHHI", 0xFD, status, 0, rowcount)
+
+    def login_response(self, payload):
+        tds_version, requested = unpack("<II", payload[4:12])
+
+        self.tds71 = tds_version >= 0x71000001
+        previous = self.packetsize
+
+        if requested:
+            self.packetsize = max(512, min(requested, self.server_max))
+
+        loginack_body = pack("<B", 1) + pack(">I", 0x07010000 if self.tds71 else 0x07000000) + b_varchar(u"standin") + pack("<BBBB", 1, 0, 0, 0)
+        envchange_body = pack("<B", 4) + b_varchar(str(self.packetsize)) + b_varchar(str(previous))
+
+        return (
+            pack("<BH", 0xAD, len(loginack_body)) + loginack_body +
+            pack("<BH", 0xE3, len(envchange_body)) + envchange_body +
+            self.done()
+        )
+
+    def column_metadata(self):
+        tokens = [pack("<BH", 0x81, len(TABLE_COLUMNS))]
+
+        for name, type_token, definition in TABLE_COLUMNS:
+            collation = b"\x09\x04\xd0\x00\x34" if self.tds71 and type_token == 0xA7 else b""
+            tokens.append(pack("<HHB", 0, 0x0009, type_token) + definition + collation + b_varchar(name))
+
+        return b"".join(tokens)
+
+    def batch_response(self, query):
+        response = self.column_metadata() if "FMTONLY" in query.upper() else b""
+        return response + self.done()
+
+    def bulk_response(self, payload):
+        return self.done(0x0010)
+
+    def run(self):
+        try:
+            while True:
+                packet_type, payload = self.receive_message()
+
+                if packet_type == TDS_PRELOGIN:
+                    # VERSION option then ENCRYPTION option set to "not supported"
+                    options = pack(">BHH", 0x00, 11, 6) + pack(">BHH", 0x01, 17, 1) + b"\xff"
+                    self.send_message(TDS_REPLY, options + pack(">IH", 0x0F000000, 0) + b"\x02")
+                elif packet_type == TDS_LOGIN7:
+                    self.send_message(TDS_REPLY, self.login_response(payload))
+                elif packet_type == TDS_SQL_BATCH:
+                    self.send_message(TDS_REPLY, self.batch_response(payload.decode("utf-16-le", "replace")))
+                elif packet_type == TDS_BULK:
+                    self.send_message(TDS_REPLY, self.bulk_response(payload))
+                else:
+                    self.send_message(TDS_REPLY, self.done())
+        except (EOFError, IOError, OSError):
+            pass
+        finally:
+            self.connection.close()
+
+class StandInServer(Thread):
+    """ Accept connections on the loopback interface """
+
+    def __init__(self, server_max, session_class=StandInSession):
+        super(StandInServer, self).__init__()
+        self.daemon = True
+        self.server_max = server_max
+        self.session_class = session_class
+        self.listener = socket(AF_INET, SOCK_STREAM)
+        self.listener.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1)
+        self.listener.bind(("127.0.0.1", 0))
+        self.listener.listen(8)
+        self.port = self.listener.getsockname()[1]
+
+    def run(self):
+        while True:
+            connection, address = self.listener.accept()
+            self.session_class(connection, self.server_max).start()
+
+def write_freetds_conf(port):
+    fileno, filename = mkstemp(suffix=".conf", text=True)
+
+    os.write(fileno, "\n".join([
+        "[standin]",
+        "    host = 127.0.0.1",
+        "    port = %d" % port,
+        "    tds version = 7.0",
+        "",
+    ]).encode())
+
+    os.close(fileno)
+    return filename
+
+def measure(packetsize, rows, batchsize):
+    bcp_connection = bcp.Connection(
+        server="standin",
+        username="bench",
+        password="bench",
+        database="bench",
+        batchsize=batchsize,
+        packetsize=packetsize,
+    )
+
+    bcp_connection.init("bench_table")
+
+    row = ["x" * 64, 42, 3.25]
+    started = time()
+
+    for index in range(rows):
+        bcp_connection.send(row)
+
+    bcp_connection.done()
+    elapsed = time() - started
+
+    negotiated = bcp_connection.packetsize
+    bcp_connection.disconnect()
+
+    return negotiated, elapsed
+
+def main(argv):
+    (options, args) = ApplicationOptions().parse_args(argv)
+
+    server = StandInServer(options.server_max)
+    server.start()
+
+    conf_file = write_freetds_conf(server.port)
+    environ["FREETDSCONF"] = conf_file
+
+    try:
+        print("%-10s %-10s %12s %12s" % ("requested", "negotiated", "rows/sec", "seconds"))
+
+        for size in options.sizes.split(","):
+            packetsize = size if size == "auto" else int(size)
+            negotiated, elapsed = measure(packetsize, options.rows, options.batchsize)
+            print("%-10s %-10d %12.0f %12.3f" % (size, negotiated, options.rows / elapsed, elapsed))
+    finally:
+        remove(conf_file)
+
+if __name__ == "__main__":
+    from sys import exit, argv, stderr
+
+    try:
+        main(argv[1:])
+    except KeyboardInterrupt:
+        print("Exiting due to <ctrl-c>", file=stderr)
+        exit(0)
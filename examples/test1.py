@@ -56,8 +56,8 @@ class ApplicationOptions(OptionParser, object):
             default='my_test_table',
         )
 
-myxml = minidom.parse("/tmp/fred.xml").toxml().encode('utf-16')
-nullxml = minidom.parseString("<doc>None</doc>").toxml().encode('utf-16')
+myxml = minidom.parse("/tmp/fred.xml").toxml()
+nullxml = minidom.parseString("<doc>None</doc>").toxml()
 
 ROW_DATA = [
     ['me', 2, nullxml],
@@ -6,12 +6,41 @@ capabilities of Sybase or Microsoft SQL Server via the freetds library.\n\
 (www.freetds.org)\n\n\
 e.g.\n\n\
    bcp.use_interfaces('/etc/freetds/freetds.conf')\n\n\
-   connection = bcp.Connection(server='server', username='me', password='****', database='mydb', batchsize=0)\n\n\
+   connection = bcp.Connection(server='server', username='me', password='****', database='mydb', batchsize=0, packetsize='auto')\n\n\
+Text is sent in the connection's client charset, UTF-8 unless charset= says\n\
+otherwise, and FreeTDS converts it to UCS-2 for nchar, nvarchar and ntext\n\
+columns, so str values can be sent to them as they are.\n\n\
    connection.init('mytable')\n\n\
    for row in ROWS:\n\
         connection.send(row)\n\n\
    connection.done()\
-   connection.disconnect()\
+   connection.disconnect()\n\n\
+A RowWriter avoids building a container per row:\n\n\
+   writer = connection.writer()\n\n\
+   for name, age in ROWS:\n\
+        writer(name, age)\n\n\
+Rows can be streamed between servers without becoming python objects:\n\n\
+   bcp.copy(source, 'select * from prod..trades', destination, 'reporting..trades', batchsize=50000)\n\n\
+For trickle feeds, commit on rows, bytes or age, whichever comes first:\n\n\
+   connection.streaming(batchsize=100000, batchbytes=8388608, maxlatency=2.0)\n\n\
+Stored procedures can be called in batches, one round trip per batch:\n\n\
+   statuses, outputs, errors = connection.callmany('usp_price', [(1, 'GBP', None), (2, 'USD', None)], outputs={2: 'money'})\n\n\
+dblib can't batch RPC requests, so each batch goes as one language batch of\n\
+EXEC statements with the parameters written in as typed literals. Output\n\
+parameters are given by position or name, as a list or as a dict of their SQL\n\
+types; without a type, an output is declared from its input value, and one\n\
+whose input is None as nvarchar(4000), so it comes back as str. A failing call\n\
+leaves its status and outputs None and its message in errors, the rest of the\n\
+batch still runs.\n\n\
+Repetitive string columns (python 3) can reuse their encoded values:\n\n\
+   connection.cache([0, 3], size=4096)\n\
+   print(connection.stats()['cachecolumns'])\n\n\
+Partitioned tables can be loaded a partition at a time, in parallel, through\n\
+staging tables that are switched in when done():\n\n\
+   loader = bcp.PartitionedLoader('trades', 'trade_date', server='server', username='me', password='****', database='mydb')\n\n\
+   for row in ROWS:\n\
+        loader.send(row)\n\n\
+   loader.done()\n\
 "
 
 // --------------------------------------------------------------------------------
@@ -34,6 +63,25 @@ e.g.\n\n\
 #   define PYFUNCTION_CAST PyCFunction
 #endif
 
+// METH_FASTCALL is public from 3.7, type level vectorcall from 3.9
+#if PY_MAJOR_VERSION > 3 || (PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 7)
+#   define HAVE_FASTCALL
+#endif
+
+#if PY_MAJOR_VERSION > 3 || (PY_MAJOR_VERSION == 3 && PY_MINOR_VERSION >= 9)
+#   define HAVE_VECTORCALL
+#endif
+
+#ifdef HAVE_FASTCALL
+#   define FASTCALL_PARAMETERS PyObject* const* args, Py_ssize_t nargs
+#   define FASTCALL_FLAGS METH_FASTCALL
+#   define FASTCALL_ITEMS(items, count) (items) = args; (count) = nargs
+#else
+#   define FASTCALL_PARAMETERS PyObject* args
+#   define FASTCALL_FLAGS METH_VARARGS
+#   define FASTCALL_ITEMS(items, count) (items) = &PyTuple_GET_ITEM(args, 0); (count) = PyTuple_GET_SIZE(args)
+#endif
+
 #ifndef IS_PY3K
 #   ifndef PyVarObject_HEAD_INIT
 #       define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
@@ -52,6 +100,98 @@ e.g.\n\n\
 
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+#   include <winsock2.h>
+#   include <ws2tcpip.h>
+#   include <windows.h>
+#else
+#   include <sys/socket.h>
+#   include <netinet/in.h>
+#   include <netinet/tcp.h>
+#   include <pthread.h>
+#   include <time.h>
+#   include <sys/time.h>
+#endif
+
+//=================================================================================
+//   TDS packet size limits, "auto" asks the server for the largest it will allow
+//=================================================================================
+#define BCP_MIN_PACKET_SIZE 512
+#define BCP_MAX_PACKET_SIZE 32767
+
+//=================================================================================
+//   Minimal native threading primitives for work done with the GIL released
+//=================================================================================
+#ifdef _WIN32
+    typedef CRITICAL_SECTION bcp_mutex_t;
+    typedef CONDITION_VARIABLE bcp_cond_t;
+    typedef HANDLE bcp_thread_t;
+#   define BCP_THREAD_FUNCTION(name, argument) static DWORD WINAPI name(LPVOID argument)
+#   define BCP_THREAD_RETURN return 0
+#   define bcp_mutex_init(mutex) InitializeCriticalSection(mutex)
+#   define bcp_mutex_destroy(mutex) DeleteCriticalSection(mutex)
+#   define bcp_mutex_lock(mutex) EnterCriticalSection(mutex)
+#   define bcp_mutex_unlock(mutex) LeaveCriticalSection(mutex)
+#   define bcp_cond_init(cond) InitializeConditionVariable(cond)
+#   define bcp_cond_destroy(cond)
+#   define bcp_cond_wait(cond, mutex) SleepConditionVariableCS((cond), (mutex), INFINITE)
+#   define bcp_cond_broadcast(cond) WakeAllConditionVariable(cond)
+#   define bcp_thread_start(thread, function, argument) ((*(thread) = CreateThread(NULL, 0, (function), (argument), 0, NULL)) == NULL ? -1 : 0)
+#   define bcp_thread_join(thread) (WaitForSingleObject((thread), INFINITE), CloseHandle(thread))
+#   define bcp_mutex_trylock(mutex) (TryEnterCriticalSection(mutex) ? 0 : -1)
+#   define bcp_cond_timedwait(cond, mutex, seconds) SleepConditionVariableCS((cond), (mutex), (DWORD) ((seconds) * 1000.0) + 1)
+
+    static double bcp_monotonic(void)
+    {
+        return GetTickCount64() / 1000.0;
+    }
+#else
+    typedef pthread_mutex_t bcp_mutex_t;
+    typedef pthread_cond_t bcp_cond_t;
+    typedef pthread_t bcp_thread_t;
+#   define BCP_THREAD_FUNCTION(name, argument) static void* name(void* argument)
+#   define BCP_THREAD_RETURN return NULL
+#   define bcp_mutex_init(mutex) pthread_mutex_init((mutex), NULL)
+#   define bcp_mutex_destroy(mutex) pthread_mutex_destroy(mutex)
+#   define bcp_mutex_lock(mutex) pthread_mutex_lock(mutex)
+#   define bcp_mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+#   define bcp_cond_init(cond) pthread_cond_init((cond), NULL)
+#   define bcp_cond_destroy(cond) pthread_cond_destroy(cond)
+#   define bcp_cond_wait(cond, mutex) pthread_cond_wait((cond), (mutex))
+#   define bcp_cond_broadcast(cond) pthread_cond_broadcast(cond)
+#   define bcp_thread_start(thread, function, argument) pthread_create((thread), NULL, (function), (argument))
+#   define bcp_thread_join(thread) pthread_join((thread), NULL)
+#   define bcp_mutex_trylock(mutex) pthread_mutex_trylock(mutex)
+
+    static void bcp_cond_timedwait(bcp_cond_t* cond, bcp_mutex_t* mutex, double seconds)
+    {
+        struct timeval now;
+        struct timespec until;
+        double whole = (double) (long) seconds;
+
+        gettimeofday(&now, NULL); // Condition variables wait against the realtime clock
+        until.tv_sec = now.tv_sec + (time_t) whole;
+        until.tv_nsec = now.tv_usec * 1000L + (long) ((seconds - whole) * 1e9);
+
+        if (until.tv_nsec >= 1000000000L)
+        {
+            until.tv_sec += 1;
+            until.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(cond, mutex, &until);
+    }
+
+    static double bcp_monotonic(void)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + now.tv_nsec / 1e9;
+    }
+#endif
 
 //=================================================================================
 //     Optional debugging definitions, allows logging TDS events to a file
@@ -147,9 +287,11 @@ static PyObject* python_bcp_logging(PyObject* self, PyObject* args, PyObject* kw
 //=================================================================================
 //                           Error and Message handling
 //=================================================================================
+static void report_dblib_error(DBPROCESS* dbproc, const char* message);
+
 static int bcp_message_handler(DBPROCESS* dbproc, DBINT msgno, int msgstate, int severity, char *msgtext, char *srvname, char *procname, int line)
 {
-    static char latest_message[2048];
+    char latest_message[2048];
 
     enum
     {
@@ -176,27 +318,18 @@ static int bcp_message_handler(DBPROCESS* dbproc, DBINT msgno, int msgstate, int
         msgtext
     );
 
-    if (!PyErr_Occurred())
-    {
-        PyErr_SetString(BCP_DblibError, latest_message);
-    }
-
+    report_dblib_error(dbproc, latest_message);
     return (0);
 }
 
 static int bcp_error_handler(DBPROCESS* dbproc, int severity, int dberr, int oserr, char* dberrstr, char* oserrstr)
 {
-    static char latest_message[2048];
-    void* preserved = dberrhandle(NULL); // Disable error handling within this callback
+    char latest_message[2048];
 
     if (dberr == SYBESMSG || severity < 1 || ! dberr || dberr == 156)
     {
         return(INT_CANCEL);
     }
-    else if (PyErr_Occurred())
-    {
-        return(INT_CANCEL);
-    }
 
     snprintf
     (
@@ -207,14 +340,46 @@ static int bcp_error_handler(DBPROCESS* dbproc, int severity, int dberr, int ose
         dberrstr
     );
 
-    PyErr_SetString(BCP_DblibError, latest_message);
-    dberrhandle(preserved);
+    report_dblib_error(dbproc, latest_message);
     return(INT_CANCEL);
 }
 
 //=================================================================================
 //                        Type and Object declarations
 //=================================================================================
+
+// A reusable native column buffer, it only grows to the widest value seen
+typedef struct
+{
+    BYTE* data;
+    DBINT length;
+    DBINT capacity;
+    int null; // Distinct from zero length, which is an empty value
+} BCP_ColumnValue;
+
+#ifndef IS_PY3K
+    typedef long Py_hash_t;
+#endif
+
+#define BCP_CACHE_WAYS 4
+
+typedef struct
+{
+    PyObject* key;     // The str, kept alive so identity matches stay valid
+    PyObject* encoded; // UTF-8 bytes
+    Py_hash_t hash;
+    int referenced;
+} BCP_CacheEntry;
+
+typedef struct
+{
+    BCP_CacheEntry* entries; // sets * BCP_CACHE_WAYS, NULL when not cached
+    unsigned char* hands;    // Per set CLOCK hand
+    Py_ssize_t sets;
+    Py_ssize_t hits;
+    Py_ssize_t misses;
+} BCP_ColumnCache;
+
 typedef struct
 {
     PyObject_HEAD
@@ -224,432 +389,3921 @@ typedef struct
     Py_ssize_t rowsize;
     Py_ssize_t rowcount;
     Py_ssize_t textsize;
+    int packetsize; // Negotiated TDS packet size, as reported by the server
+    int nodelay;
+    int sndbufrequest; // SO_SNDBUF asked for by the last connect(), 0 leaves it to the OS
+    int sndbuf;        // SO_SNDBUF granted by the operating system
+    int insession; // bcp_init() has been called and bcp_done() hasn't
+    int bound;     // Columns have been bound with bcp_bind() for this session
+    int nogil; // Set while native threads drive the connection without the GIL
+    char pendingerror[2048]; // First dblib error raised while nogil was set
+    Py_ssize_t batchbytes;  // Streaming mode: commit once this much data is pending
+    double maxlatency;      // Streaming mode: commit rows that have waited this many seconds
+    Py_ssize_t pendingbytes;
+    double oldestpending;   // Monotonic time the first uncommitted row was sent
+    Py_ssize_t batches;     // Number of bcp_batch() commits made
+    bcp_mutex_t lock;       // Serialises dblib use between send() and the latency timer
+    bcp_cond_t timerwake;
+    bcp_thread_t timer;
+    int timerrunning;
+    int timerstop;
+    int timerbusy;          // The timer thread is inside dblib
+    BCP_ColumnCache* caches; // Per column encoded value caches, see cache()
+    Py_ssize_t cachecount;
 } BCP_ConnectionObject;
 
+typedef struct
+{
+    PyObject_HEAD
+    BCP_ConnectionObject* connection;
+#ifdef HAVE_VECTORCALL
+    vectorcallfunc vectorcall;
+#endif
+} BCP_RowWriterObject;
+
+static PyTypeObject BCP_ConnectionType;
+static PyTypeObject BCP_RowWriterType;
+static PyTypeObject BCP_PartitionedLoaderType;
+
 //=================================================================================
-//                       Database connection methods
+// dblib calls the handlers on whichever thread is using the DBPROCESS. When that
+// thread doesn't hold the GIL the message is parked on the connection, found via
+// the dblib user data pointer, and raised once the GIL has been reacquired.
 //=================================================================================
-static PyObject* python_bcp_object_disconnect(BCP_ConnectionObject* self, PyObject* args)
+static void report_dblib_error(DBPROCESS* dbproc, const char* message)
 {
-    if (self && self->dbproc)
+    BCP_ConnectionObject* connection = dbproc ? (BCP_ConnectionObject*) dbgetuserdata(dbproc) : NULL;
+
+    if (connection != NULL && (connection->nogil || connection->timerbusy))
     {
-        dbclose(self->dbproc);
-        self->dbproc = NULL;
+        if (connection->pendingerror[0] == '\0')
+        {
+            snprintf(connection->pendingerror, sizeof(connection->pendingerror), "%s", message);
+        }
+    }
+    else if (!PyErr_Occurred())
+    {
+        PyErr_SetString(BCP_DblibError, message);
     }
-
-    Py_INCREF(Py_None);
-    return Py_None;
 }
 
-static PyObject* python_bcp_object_connect(BCP_ConnectionObject* self, PyObject* args, PyObject* kwargs)
+static int column_value_reserve(BCP_ColumnValue* value, DBINT length)
 {
-    static char *keywords[] = {"server", "username", "password", "database", "batchsize", "textsize", NULL};
-
-    const char *server = "hostname";
-    const char *username = "dkw";
-    const char *password = "";
-    const char *database = "gps_querydb";
+    if (length > value->capacity)
+    {
+        BYTE* grown = (BYTE*) realloc(value->data, length);
 
-    char query[1024];
+        if (grown == NULL)
+        {
+            return -1;
+        }
 
-    LOGINREC *login;
+        value->data = grown;
+        value->capacity = length;
+    }
 
-    python_bcp_object_disconnect(self, Py_None);
+    return 0;
+}
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|sssii", keywords, &server, &username, &password, &database, &self->batchsize, &self->textsize))
+static int column_value_set(BCP_ColumnValue* value, const BYTE* data, DBINT length)
+{
+    if (column_value_reserve(value, length) == -1)
     {
-        PyErr_SetString(BCP_ParameterError, "Invalid|incomplete parameters passed to connect()");
-        return NULL;
+        return -1;
     }
 
-    if ((login = dblogin()) == NULL)
+    if (length > 0)
     {
-        return NULL;
+        memcpy(value->data, data, length);
     }
 
-    DBSETLUSER(login, username);
-    DBSETLPWD(login, password);
-    DBSETLVERSION(login, DBVERSION_70); // Set minimal version to work with SQL Server
-    BCP_SETL(login, 1); // Enable BCP on the connection
+    value->length = length;
+    value->null = 0;
+    return 0;
+}
 
-    self->dbproc = dbopen(login, server);
-    dbloginfree(login);
+static void defer_connection_errors(BCP_ConnectionObject* connection)
+{
+    connection->pendingerror[0] = '\0';
+    connection->nogil = 1;
+}
 
-    if (self->dbproc == NULL)
+static int raise_deferred_errors(BCP_ConnectionObject* connection)
+{
+    connection->nogil = 0;
+
+    if (connection->pendingerror[0] != '\0')
     {
         if (!PyErr_Occurred())
         {
-            PyErr_SetString(BCP_LoginError, "failed connecting to server");
+            PyErr_SetString(BCP_DblibError, connection->pendingerror);
         }
 
-        return NULL;
+        connection->pendingerror[0] = '\0';
+        return -1;
     }
 
-    dbuse(self->dbproc, database);
+    return 0;
+}
 
-    if (PyErr_Occurred())
+// copy(), callmany() and partitioned loads drive the DBPROCESS from threads without
+// the GIL; nothing else may touch it until they have finished
+static int connection_in_use(BCP_ConnectionObject* connection)
+{
+    if (connection->nogil)
     {
-        return NULL;
+        PyErr_SetString(BCP_SessionError, "Connection is in use by a native operation");
+        return 1;
     }
 
-    snprintf(query, sizeof(query), "set textsize %d", (int) self->textsize);
-    dbfcmd(self->dbproc, query);
-    dbsqlexec(self->dbproc);
-    while (dbresults(self->dbproc) != NO_MORE_RESULTS);
-
-    /*
-    snprintf(query, sizeof(query), "set quoted_identifier on");
-    dbfcmd(self->dbproc, query);
-    dbsqlexec(self->dbproc);
-    while (dbresults(self->dbproc) != NO_MORE_RESULTS);
-    */
-
-    Py_INCREF(Py_None);
-
-    return Py_None;
+    return 0;
 }
 
 //=================================================================================
-//      Begin a bcp data transfer "session" for a database table
+//  While the latency timer runs, dblib use on the connection is serialised. The
+//  GIL is only given up when the timer is actually holding the lock.
 //=================================================================================
-static PyObject* python_bcp_object_session_init(BCP_ConnectionObject* self, PyObject* args)
+static void lock_connection(BCP_ConnectionObject* self)
 {
-    const char *table_name;
+    if (self->timerrunning && bcp_mutex_trylock(&self->lock) != 0)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        bcp_mutex_lock(&self->lock);
+        Py_END_ALLOW_THREADS
+    }
+}
 
-    if (!PyArg_ParseTuple(args, "s", &table_name))
+static void unlock_connection(BCP_ConnectionObject* self)
+{
+    if (self->timerrunning)
     {
-        PyErr_SetString(BCP_ParameterError, "Invalid table name passed to session init");
-        return NULL;
+        bcp_mutex_unlock(&self->lock);
     }
+}
 
-    if (bcp_init(self->dbproc, table_name, NULL,NULL, DB_IN) == FAIL)
+// Commit the rows sent so far in the current session, the caller holds the lock
+static DBINT commit_pending_rows(BCP_ConnectionObject* self)
+{
+    DBINT rows = bcp_batch(self->dbproc);
+
+    if (rows != -1)
     {
-        PyErr_SetString(BCP_SessionError, "failed to create bcp session for the specified table");
-        return NULL;
+        self->batchrows = 0;
+        self->pendingbytes = 0;
+        ++self->batches;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    return rows;
 }
 
 //=================================================================================
-//               Allow user to set control parameters for bcp session
+//  Latency timer: commits the pending rows once the oldest has waited maxlatency
+//  seconds, even if the producer has gone quiet
 //=================================================================================
-static PyObject* python_bcp_object_session_control(BCP_ConnectionObject* self, PyObject* args)
+BCP_THREAD_FUNCTION(latency_timer_thread, argument)
 {
-    Py_ssize_t field;
-    Py_ssize_t value;
+    BCP_ConnectionObject* self = (BCP_ConnectionObject*) argument;
 
-    if (!PyArg_ParseTuple(args, "ii", &field, &value))
+    bcp_mutex_lock(&self->lock);
+
+    while (! self->timerstop)
     {
-        PyErr_SetString(BCP_ParameterError, "bcp_control needs valid integer field specifier and value");
-        return NULL;
+        double remaining;
+
+        if (! self->insession || self->batchrows == 0 || self->nogil)
+        {
+            bcp_cond_wait(&self->timerwake, &self->lock); // Idle until a row is pending
+        }
+        else if ((remaining = self->oldestpending + self->maxlatency - bcp_monotonic()) > 0)
+        {
+            bcp_cond_timedwait(&self->timerwake, &self->lock, remaining);
+        }
+        else
+        {
+            self->timerbusy = 1;
+
+            if (commit_pending_rows(self) == -1 && self->pendingerror[0] == '\0')
+            {
+                snprintf(self->pendingerror, sizeof(self->pendingerror), "Failed during bcp_batch()");
+            }
+
+            self->timerbusy = 0;
+
+            if (self->pendingerror[0] != '\0')
+            {
+                self->batchrows = 0; // Don't retry, send() reports the failure
+            }
+        }
     }
 
-    bcp_control(self->dbproc, field, value);
-    Py_INCREF(Py_None);
-    return Py_None;
+    bcp_mutex_unlock(&self->lock);
+    BCP_THREAD_RETURN;
 }
 
-//=================================================================================
-// Iterate through list of field values for a single row of bcp values, then
-// send the row to the database server
-//=================================================================================
-static PyObject* python_bcp_object_sendrow(BCP_ConnectionObject* self, PyObject* args)
+static void stop_latency_timer(BCP_ConnectionObject* self)
 {
-    static unsigned char* nullstr = (unsigned char*) "";
+    if (! self->timerrunning)
+    {
+        return;
+    }
 
-    PyObject* row_list;
-    Py_ssize_t item_count;
-    Py_ssize_t index;
+    lock_connection(self);
+    self->timerstop = 1;
+    bcp_cond_broadcast(&self->timerwake);
+    unlock_connection(self);
 
-    unsigned char** field_data = NULL;
-    Py_ssize_t *field_sizes = NULL;
+    Py_BEGIN_ALLOW_THREADS
+    bcp_thread_join(self->timer);
+    Py_END_ALLOW_THREADS
 
-    if (!PyArg_ParseTuple(args, "O", &row_list))
+    self->timerrunning = 0;
+}
+
+//=================================================================================
+//  Translate the packetsize connection parameter, which is either an integer or
+//  the string "auto", into the value requested in the login record
+//=================================================================================
+static int parse_packet_size(PyObject* option, int* packetsize)
+{
+    long value;
+
+    if (option == NULL || option == Py_None)
     {
-        PyErr_SetString(BCP_ParameterError, "Invalid column data passed to sendrow()");
+        *packetsize = 0; // Leave it to the server default
+        return 0;
     }
-    else if (!PyList_Check(row_list))
+
+#ifdef IS_PY3K
+    if (PyUnicode_Check(option))
     {
-        PyErr_SetString(PyExc_ValueError, "Must use a list for sendrow()");
-    }
-    else if ((item_count = PyList_Size(row_list)) < (self->rowsize ? self->rowsize : 1))
+        if (PyUnicode_CompareWithASCIIString(option, "auto") == 0)
+#else
+    if (PyString_Check(option))
     {
-        PyErr_SetString(PyExc_ValueError, "Can only sendrow() using non-zero length lists of the same size");
+        if (strcmp(PyString_AsString(option), "auto") == 0)
+#endif
+        {
+            *packetsize = BCP_MAX_PACKET_SIZE;
+            return 0;
+        }
+
+        PyErr_SetString(BCP_ParameterError, "packetsize must be an integer or 'auto'");
+        return -1;
     }
-    else if (self->rowsize == 0)
+
+    if ((value = PyLong_AsLong(option)) == -1 && PyErr_Occurred())
     {
-        self->rowsize = item_count;
+        PyErr_Clear();
+        PyErr_SetString(BCP_ParameterError, "packetsize must be an integer or 'auto'");
+        return -1;
     }
 
-    if (PyErr_Occurred()) {
-        return NULL;
+    if (value < BCP_MIN_PACKET_SIZE || value > BCP_MAX_PACKET_SIZE)
+    {
+        PyErr_Format(BCP_ParameterError, "packetsize must be between %d and %d", BCP_MIN_PACKET_SIZE, BCP_MAX_PACKET_SIZE);
+        return -1;
     }
-    
-    if ((field_data = (unsigned char**) malloc(self->rowsize * sizeof(unsigned char*))) == NULL)
+
+    *packetsize = (int) value;
+    return 0;
+}
+
+//=================================================================================
+//   Apply the requested socket options to the connection's underlying socket and
+//   record the values the operating system actually granted
+//=================================================================================
+static int configure_socket(BCP_ConnectionObject* self)
+{
+    int descriptor = dbiowdesc(self->dbproc);
+    socklen_t length = sizeof(self->sndbuf);
+
+    if (descriptor < 0)
     {
-        PyErr_SetString(BCP_DataError, "Couldn't allocate column field data storage");
+        PyErr_SetString(BCP_LoginError, "couldn't obtain the connection socket");
+        return -1;
     }
-    else if ((field_sizes = (Py_ssize_t*) malloc(self->rowsize * sizeof(Py_ssize_t))) == NULL)
+
+    if (setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, (const char*) &self->nodelay, sizeof(self->nodelay)) != 0)
     {
-        PyErr_SetString(BCP_DataError, "Couldn't allocate column field data storage");
+        PyErr_SetString(BCP_LoginError, "couldn't set TCP_NODELAY on the connection socket");
+        return -1;
     }
 
-    if (PyErr_Occurred())
+    // Only set when asked for on this connect, an explicit size disables autotuning
+    if (self->sndbufrequest > 0 && setsockopt(descriptor, SOL_SOCKET, SO_SNDBUF, (const char*) &self->sndbufrequest, sizeof(self->sndbufrequest)) != 0)
     {
-        if (field_sizes != NULL) free(field_sizes);
-        if (field_data != NULL) free(field_data);
-        return NULL;
+        PyErr_SetString(BCP_LoginError, "couldn't set SO_SNDBUF on the connection socket");
+        return -1;
     }
 
-    memset(field_data, 0, self->rowsize * sizeof(field_data[0]));
-    memset(field_sizes, 0, self->rowsize * sizeof(field_sizes[0]));
-    
-    for (index = 0; index < self->rowsize && ! PyErr_Occurred(); ++index)
+    if (getsockopt(descriptor, SOL_SOCKET, SO_SNDBUF, (char*) &self->sndbuf, &length) != 0)
     {
-        int bcp_column_position = index + 1; // Column position starts at 1
-        int bind_as_null = 0;
+        self->sndbuf = 0;
+    }
+
+    return 0;
+}
 
-        PyObject* item = PyList_GetItem(row_list, index);
-        PyObject* str = NULL;
-        PyObject* unicode = NULL;
+//=================================================================================
+//  Copy text into a buffer as the body of a single quoted SQL string literal,
+//  doubling embedded quotes. Fails if the result doesn't fit.
+//=================================================================================
+static int quote_sql_literal(const char* text, char* quoted, size_t size)
+{
+    size_t position = 0;
 
-        if (item == NULL) // Invalid object raises an error
-        {
-            PyErr_SetString(BCP_DataError, "Could not retrieve value from list");
-        }
-        else if (item == Py_None) // If item is Python None object, then just write NULL column
-        {
-            bind_as_null = 1;
-        }
-        else if ((str = PyObject_Str(item)) == NULL)
+    for (; *text && position < size - 2; ++text)
+    {
+        if (*text == '\'')
         {
-            PyErr_SetString(BCP_DataError, "Couldn't get copy of column data");
+            quoted[position++] = '\'';
         }
-#ifdef IS_PY3K
-        // See: https://github.com/dabeaz/python-cookbook/blob/master/src/15/reading_file_like_objects_from_c/sample.c
-        else if ((unicode = PyUnicode_AsEncodedString(str, "utf-8", "strict")) == NULL)
+
+        quoted[position++] = *text;
+    }
+
+    quoted[position] = '\0';
+    return *text ? -1 : 0;
+}
+
+//=================================================================================
+//  Copy a name into a buffer as a bracket quoted SQL identifier, doubling
+//  embedded closing brackets. Fails if the result doesn't fit.
+//=================================================================================
+static int quote_sql_identifier(const char* name, char* quoted, size_t size)
+{
+    size_t position = 0;
+
+    quoted[position++] = '[';
+
+    for (; *name && position < size - 3; ++name)
+    {
+        if (*name == ']')
         {
-            PyErr_SetString(BCP_DataError, "Couldn't get unicode representation of column data");
-            Py_XDECREF(str);
+            quoted[position++] = ']';
         }
-#endif
 
-        else
-        {
-            char *ptr;
+        quoted[position++] = *name;
+    }
 
-#ifdef IS_PY3K
-            Py_XDECREF(str);
-            str = unicode;
+    quoted[position++] = ']';
+    quoted[position] = '\0';
+    return *name ? -1 : 0;
+}
 
-            if (PyBytes_AsStringAndSize(str, &ptr, &field_sizes[index]) == -1)
-#else
-            if (PyString_AsStringAndSize(str, &ptr, &field_sizes[index]) == -1)
-#endif
-            {
-                PyErr_SetString(BCP_DataError, "Couldn't get details from column source");
+//=================================================================================
+//  Encoded value cache for low cardinality string columns. Each cached column
+//  maps str values, by identity or equal contents, to a bytes object holding the
+//  encoded form, so repeated values are bound by pointer without re-encoding.
+//  Tables are 4-way set associative with CLOCK eviction within each set.
+//=================================================================================
+static void column_cache_clear(BCP_ColumnCache* cache)
+{
+    Py_ssize_t index;
+
+    if (cache->entries != NULL)
+    {
+        for (index = 0; index < cache->sets * BCP_CACHE_WAYS; ++index)
+        {
+            Py_XDECREF(cache->entries[index].key);
+            Py_XDECREF(cache->entries[index].encoded);
+        }
+    }
+
+    free(cache->entries);
+    free(cache->hands);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Drop the cached values but keep the table, e.g. when a new bcp session starts
+static void column_cache_empty(BCP_ColumnCache* cache)
+{
+    Py_ssize_t index;
+
+    for (index = 0; cache->entries != NULL && index < cache->sets * BCP_CACHE_WAYS; ++index)
+    {
+        Py_CLEAR(cache->entries[index].key);
+        Py_CLEAR(cache->entries[index].encoded);
+        cache->entries[index].referenced = 0;
+    }
+
+    if (cache->hands != NULL)
+    {
+        memset(cache->hands, 0, cache->sets);
+    }
+}
+
+static int column_cache_init(BCP_ColumnCache* cache, Py_ssize_t size)
+{
+    Py_ssize_t sets = 1;
+
+    while (sets * BCP_CACHE_WAYS < size)
+    {
+        sets <<= 1; // Power of two, so the hash can be masked
+    }
+
+    column_cache_clear(cache);
+
+    if ((cache->entries = (BCP_CacheEntry*) calloc(sets * BCP_CACHE_WAYS, sizeof(BCP_CacheEntry))) == NULL || (cache->hands = (unsigned char*) calloc(sets, 1)) == NULL)
+    {
+        column_cache_clear(cache);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    cache->sets = sets;
+    return 0;
+}
+
+#ifdef IS_PY3K
+// Returns a borrowed reference to the encoded bytes, owned by the cache
+static PyObject* column_cache_lookup(BCP_ColumnCache* cache, PyObject* item)
+{
+    Py_hash_t hash = PyObject_Hash(item); // Cached in the str after the first call
+    Py_ssize_t set = (Py_ssize_t) ((size_t) hash & (size_t) (cache->sets - 1));
+    BCP_CacheEntry* ways = &cache->entries[set * BCP_CACHE_WAYS];
+    BCP_CacheEntry* victim;
+    PyObject* encoded;
+    int way;
+
+    if (hash == -1)
+    {
+        return NULL;
+    }
+
+    for (way = 0; way < BCP_CACHE_WAYS; ++way)
+    {
+        if (ways[way].key == item || (ways[way].key != NULL && ways[way].hash == hash && PyUnicode_Compare(ways[way].key, item) == 0))
+        {
+            ways[way].referenced = 1;
+            ++cache->hits;
+            return ways[way].encoded;
+        }
+    }
+
+    ++cache->misses;
+
+    if ((encoded = PyUnicode_AsUTF8String(item)) == NULL)
+    {
+        return NULL;
+    }
+
+    // CLOCK: skip recently referenced ways, clearing their bit as the hand passes
+    for (;;)
+    {
+        victim = &ways[cache->hands[set]];
+        cache->hands[set] = (cache->hands[set] + 1) % BCP_CACHE_WAYS;
+
+        if (! victim->referenced)
+        {
+            break;
+        }
+
+        victim->referenced = 0;
+    }
+
+    Py_XDECREF(victim->key);
+    Py_XDECREF(victim->encoded);
+    Py_INCREF(item);
+    victim->key = item;
+    victim->encoded = encoded;
+    victim->hash = hash;
+    victim->referenced = 1;
+
+    return encoded;
+}
+#endif
+
+//=================================================================================
+//                       Database connection methods
+//=================================================================================
+static PyObject* python_bcp_object_disconnect(BCP_ConnectionObject* self, PyObject* args)
+{
+    if (self && connection_in_use(self))
+    {
+        return NULL;
+    }
+
+    if (self)
+    {
+        stop_latency_timer(self);
+    }
+
+    if (self && self->dbproc)
+    {
+        dbclose(self->dbproc);
+        self->dbproc = NULL;
+        self->insession = 0;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* python_bcp_object_connect(BCP_ConnectionObject* self, PyObject* args, PyObject* kwargs)
+{
+    static char *keywords[] = {"server", "username", "password", "database", "batchsize", "textsize", "packetsize", "nodelay", "sndbuf", "charset", NULL};
+
+    const char *server = "hostname";
+    const char *username = "dkw";
+    const char *password = "";
+    const char *database = "gps_querydb";
+    const char *charset = "UTF-8"; // The encoding values are sent in, FreeTDS converts them for n-type columns
+
+    PyObject *packetsize = NULL;
+    int requested_packetsize = 0;
+    int requested_sndbuf = 0;
+
+    char query[1024];
+
+    LOGINREC *login;
+
+    if (python_bcp_object_disconnect(self, Py_None) == NULL)
+    {
+        return NULL;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|sssiiOiis", keywords, &server, &username, &password, &database, &self->batchsize, &self->textsize, &packetsize, &self->nodelay, &requested_sndbuf, &charset))
+    {
+        PyErr_SetString(BCP_ParameterError, "Invalid|incomplete parameters passed to connect()");
+        return NULL;
+    }
+
+    if (parse_packet_size(packetsize, &requested_packetsize) == -1)
+    {
+        return NULL;
+    }
+
+    self->sndbufrequest = requested_sndbuf;
+
+    if ((login = dblogin()) == NULL)
+    {
+        return NULL;
+    }
+
+    DBSETLUSER(login, username);
+    DBSETLPWD(login, password);
+    DBSETLVERSION(login, DBVERSION_70); // Set minimal version to work with SQL Server
+    DBSETLCHARSET(login, charset);
+    BCP_SETL(login, 1); // Enable BCP on the connection
+
+    if (requested_packetsize > 0)
+    {
+        DBSETLPACKET(login, requested_packetsize); // Server may negotiate this down
+    }
+
+    self->dbproc = dbopen(login, server);
+    dbloginfree(login);
+
+    if (self->dbproc == NULL)
+    {
+        if (!PyErr_Occurred())
+        {
+            PyErr_SetString(BCP_LoginError, "failed connecting to server");
+        }
+
+        return NULL;
+    }
+
+    dbsetuserdata(self->dbproc, (BYTE*) self);
+    self->packetsize = dbgetpacket(self->dbproc);
+
+    if (configure_socket(self) == -1)
+    {
+        return NULL;
+    }
+
+    dbuse(self->dbproc, database);
+
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+
+    snprintf(query, sizeof(query), "set textsize %d", (int) self->textsize);
+    dbfcmd(self->dbproc, query);
+    dbsqlexec(self->dbproc);
+    while (dbresults(self->dbproc) != NO_MORE_RESULTS);
+
+    /*
+    snprintf(query, sizeof(query), "set quoted_identifier on");
+    dbfcmd(self->dbproc, query);
+    dbsqlexec(self->dbproc);
+    while (dbresults(self->dbproc) != NO_MORE_RESULTS);
+    */
+
+    Py_INCREF(Py_None);
+
+    return Py_None;
+}
+
+//=================================================================================
+//      Begin a bcp data transfer "session" for a database table
+//=================================================================================
+static PyObject* python_bcp_object_session_init(BCP_ConnectionObject* self, PyObject* args)
+{
+    const char *table_name;
+    Py_ssize_t index;
+
+    if (!PyArg_ParseTuple(args, "s", &table_name))
+    {
+        PyErr_SetString(BCP_ParameterError, "Invalid table name passed to session init");
+        return NULL;
+    }
+
+    if (self->dbproc == NULL)
+    {
+        PyErr_SetString(BCP_SessionError, "Not connected to a server");
+        return NULL;
+    }
+
+    if (connection_in_use(self))
+    {
+        return NULL;
+    }
+
+    lock_connection(self);
+    self->insession = 0;
+
+    for (index = 0; index < self->cachecount; ++index)
+    {
+        column_cache_empty(&self->caches[index]); // Positions may name other columns now
+    }
+
+    if (bcp_init(self->dbproc, table_name, NULL,NULL, DB_IN) == FAIL)
+    {
+        unlock_connection(self);
+        PyErr_SetString(BCP_SessionError, "failed to create bcp session for the specified table");
+        return NULL;
+    }
+
+    self->insession = 1;
+    self->bound = 0;
+    self->rowsize = 0;
+    self->batchrows = 0;
+    self->pendingbytes = 0;
+    unlock_connection(self);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+//=================================================================================
+//               Allow user to set control parameters for bcp session
+//=================================================================================
+static PyObject* python_bcp_object_session_control(BCP_ConnectionObject* self, PyObject* args)
+{
+    Py_ssize_t field;
+    Py_ssize_t value;
+
+    if (!PyArg_ParseTuple(args, "ii", &field, &value))
+    {
+        PyErr_SetString(BCP_ParameterError, "bcp_control needs valid integer field specifier and value");
+        return NULL;
+    }
+
+    if (connection_in_use(self))
+    {
+        return NULL;
+    }
+
+    lock_connection(self);
+    bcp_control(self->dbproc, field, value);
+    unlock_connection(self);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+//=================================================================================
+// Produce the character representation of a column value. The returned holder
+// keeps the data alive until the row has been sent; for str values on Python 3
+// this is the object's own cached UTF-8 buffer, so nothing is copied.
+//=================================================================================
+static int encode_column_value(PyObject* item, PyObject** holder, char** data, Py_ssize_t* size)
+{
+    PyObject* str;
+
+#ifdef IS_PY3K
+    if (PyUnicode_Check(item))
+    {
+        Py_INCREF(item);
+        str = item;
+    }
+    else
+#else
+    if (PyUnicode_Check(item)) // Sent as UTF-8, the same as str on python 3
+    {
+        if ((str = PyUnicode_AsUTF8String(item)) == NULL)
+        {
+            PyErr_SetString(BCP_DataError, "Couldn't get UTF-8 copy of unicode column data");
+            return -1;
+        }
+    }
+    else
+#endif
+    if ((str = PyObject_Str(item)) == NULL)
+    {
+        PyErr_SetString(BCP_DataError, "Couldn't get copy of column data");
+        return -1;
+    }
+
+#ifdef IS_PY3K
+    if ((*data = (char*) PyUnicode_AsUTF8AndSize(str, size)) == NULL)
+    {
+        Py_DECREF(str);
+        PyErr_SetString(BCP_DataError, "Couldn't get unicode representation of column data");
+        return -1;
+    }
+#else
+    if (PyString_AsStringAndSize(str, data, size) == -1)
+    {
+        Py_DECREF(str);
+        PyErr_SetString(BCP_DataError, "Couldn't get details from column source");
+        return -1;
+    }
+#endif
+
+    *holder = str;
+    return 0;
+}
+
+//=================================================================================
+// Bind each column value of a single row of bcp values, then send the row to the
+// database server. The values are borrowed from the caller's list, tuple or
+// argument vector so no intermediate container is built. Every value is encoded
+// before the connection is locked: str() can run python code, which mustn't
+// hold up the latency timer or find the lock taken if it sends a row itself.
+//=================================================================================
+#define BCP_ROW_STACK_ITEMS 64 // Rows up to this wide are handled without allocating
+
+typedef struct
+{
+    PyObject* holder; // Keeps data alive until the row is sent, NULL for NULL values
+    unsigned char* data;
+    Py_ssize_t width; // Zero length binds the column as NULL
+} BCP_EncodedColumn;
+
+// Returns the number of columns encoded, fewer than count if an error was raised
+static Py_ssize_t encode_row_values(BCP_ConnectionObject* self, PyObject* const* items, BCP_EncodedColumn* columns, Py_ssize_t count)
+{
+    static unsigned char* nullstr = (unsigned char*) "";
+
+    Py_ssize_t index;
+
+    for (index = 0; index < count; ++index)
+    {
+        PyObject* item = items[index];
+        BCP_EncodedColumn* column = &columns[index];
+
+        column->holder = NULL;
+        column->data = nullstr;
+        column->width = 0;
+
+        if (item == NULL) // Invalid object raises an error
+        {
+            PyErr_SetString(BCP_DataError, "Could not retrieve value from row");
+            return index;
+        }
+        else if (item == Py_None) // If item is Python None object, then just write NULL column
+        {
+        }
+#ifdef IS_PY3K
+        else if (index < self->cachecount && self->caches[index].entries != NULL && PyUnicode_CheckExact(item))
+        {
+            PyObject* encoded = column_cache_lookup(&self->caches[index], item);
+
+            if (encoded == NULL)
+            {
+                return index;
+            }
+
+            Py_INCREF(encoded); // A later lookup may evict it from the cache
+            column->holder = encoded;
+            column->data = (unsigned char*) PyBytes_AS_STRING(encoded);
+            column->width = PyBytes_GET_SIZE(encoded);
+        }
+#endif
+        else
+        {
+            char* ptr;
+
+            if (encode_column_value(item, &column->holder, &ptr, &column->width) == -1)
+            {
+                return index;
+            }
+
+            column->data = (unsigned char*) ptr;
+        }
+    }
+
+    return count;
+}
+
+static int send_row_values(BCP_ConnectionObject* self, PyObject* const* items, Py_ssize_t item_count)
+{
+    BCP_EncodedColumn stack[BCP_ROW_STACK_ITEMS];
+    BCP_EncodedColumn* columns = stack;
+    Py_ssize_t rowsize = self->rowsize ? self->rowsize : item_count;
+    Py_ssize_t encoded;
+    Py_ssize_t index;
+    Py_ssize_t row_bytes = 0;
+
+    if (self->dbproc == NULL || ! self->insession)
+    {
+        PyErr_SetString(BCP_SessionError, "No bcp session is active, call init() first");
+        return -1;
+    }
+
+    if (connection_in_use(self))
+    {
+        return -1;
+    }
+
+    if (item_count < (rowsize ? rowsize : 1))
+    {
+        PyErr_SetString(PyExc_ValueError, "Can only send() rows with a non-zero number of columns, the same for every row");
+        return -1;
+    }
+
+    if (rowsize > BCP_ROW_STACK_ITEMS && (columns = (BCP_EncodedColumn*) calloc(rowsize, sizeof(BCP_EncodedColumn))) == NULL)
+    {
+        PyErr_SetString(BCP_DataError, "Couldn't allocate column field data storage");
+        return -1;
+    }
+
+    if ((encoded = encode_row_values(self, items, columns, rowsize)) == rowsize)
+    {
+        for (index = 0; index < rowsize; ++index)
+        {
+            row_bytes += columns[index].width;
+        }
+
+        // A row sent while encoding may have fixed the row size or ended the session
+        if (self->rowsize != 0 && self->rowsize != rowsize)
+        {
+            PyErr_SetString(PyExc_ValueError, "Can only send() rows with a non-zero number of columns, the same for every row");
+        }
+        else if (self->dbproc == NULL || ! self->insession)
+        {
+            PyErr_SetString(BCP_SessionError, "No bcp session is active, call init() first");
+        }
+        else if (! connection_in_use(self))
+        {
+            self->rowsize = rowsize;
+        }
+    }
+
+    if (! PyErr_Occurred())
+    {
+        lock_connection(self);
+
+        if (self->pendingerror[0] != '\0') // The latency timer's last commit failed
+        {
+            PyErr_SetString(BCP_DblibError, self->pendingerror);
+            self->pendingerror[0] = '\0';
+        }
+
+        for (index = 0; index < rowsize && ! PyErr_Occurred(); ++index)
+        {
+            int bcp_column_position = index + 1; // Column position starts at 1
+
+            if (! self->bound) // Must bind before first sendrow
+            {
+                if (bcp_bind(self->dbproc, columns[index].data, 0, (DBINT) columns[index].width, NULL, 0, SYBVARCHAR, bcp_column_position) == FAIL)
+                {
+                    PyErr_SetString(BCP_DataError, "call to bcp_bind() failed");
+                }
+            }
+            else if (bcp_colptr(self->dbproc, columns[index].data, bcp_column_position) == FAIL)
+            {
+                PyErr_SetString(BCP_DataError, "call to bcp_colptr() for column failed");
+            }
+            else if (bcp_collen(self->dbproc, (DBINT) columns[index].width, bcp_column_position) == FAIL)
+            {
+                PyErr_SetString(BCP_DataError, "call to bcp_collen() for column failed");
+            }
+        }
+
+        if (! PyErr_Occurred())
+        {
+            self->bound = 1;
+
+            if (bcp_sendrow(self->dbproc) == FAIL)
+            {
+                if (! PyErr_Occurred())
+                {
+                    PyErr_SetString(BCP_DataError, "Failed during bcp_sendrow()");
+                }
+            }
+            else
+            {
+                if (self->batchrows++ == 0)
+                {
+                    self->oldestpending = bcp_monotonic();
+
+                    if (self->timerrunning)
+                    {
+                        bcp_cond_broadcast(&self->timerwake); // Start the latency deadline
+                    }
+                }
+
+                self->pendingbytes += row_bytes;
+
+                // Remember, batchsize can be changed by the client, so don't
+                // try to use modulo arithmetic on rowcount instead
+                if ((self->batchsize > 0 && self->batchrows >= self->batchsize) || (self->batchbytes > 0 && self->pendingbytes >= self->batchbytes))
+                {
+                    if (commit_pending_rows(self) == -1 && ! PyErr_Occurred())
+                    {
+                        PyErr_SetString(BCP_DataError, "Failed during bcp_batch()");
+                    }
+                }
+            }
+        }
+
+        unlock_connection(self);
+    }
+
+    // ================================================
+    // Release the values that backed the sendrow data
+    // ================================================
+    for (index = 0; index < encoded; ++index)
+    {
+        Py_XDECREF(columns[index].holder);
+    }
+
+    if (columns != stack)
+    {
+        free(columns);
+    }
+
+    if (PyErr_Occurred())
+    {
+        return -1;
+    }
+
+    ++self->rowcount;
+    return 0;
+}
+
+//=================================================================================
+//  Column values of a list or tuple row. A list's items are referenced until
+//  row_items_release(), because converting a value can run Python code that
+//  changes the list. Rows wider than the caller's stack array are allocated.
+//=================================================================================
+static PyObject* const* row_items_acquire(PyObject* row, PyObject** stack, Py_ssize_t* count)
+{
+    PyObject** items = stack;
+    Py_ssize_t index;
+
+    if (PyTuple_Check(row))
+    {
+        *count = PyTuple_GET_SIZE(row);
+        return &PyTuple_GET_ITEM(row, 0);
+    }
+
+    *count = PyList_GET_SIZE(row);
+
+    if (*count > BCP_ROW_STACK_ITEMS && (items = (PyObject**) malloc(*count * sizeof(PyObject*))) == NULL)
+    {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    for (index = 0; index < *count; ++index)
+    {
+        items[index] = PyList_GET_ITEM(row, index);
+        Py_INCREF(items[index]);
+    }
+
+    return items;
+}
+
+static void row_items_release(PyObject* row, PyObject* const* items, PyObject** stack, Py_ssize_t count)
+{
+    Py_ssize_t index;
+
+    if (PyTuple_Check(row))
+    {
+        return;
+    }
+
+    for (index = 0; index < count; ++index)
+    {
+        Py_DECREF(items[index]);
+    }
+
+    if (items != stack)
+    {
+        free((void*) items);
+    }
+}
+
+static int send_row_sequence(BCP_ConnectionObject* self, PyObject* row)
+{
+    PyObject* stack[BCP_ROW_STACK_ITEMS];
+    PyObject* const* items;
+    Py_ssize_t count;
+    int result;
+
+    if ((items = row_items_acquire(row, stack, &count)) == NULL)
+    {
+        return -1;
+    }
+
+    result = send_row_values(self, items, count);
+    row_items_release(row, items, stack, count);
+    return result;
+}
+
+//=================================================================================
+//              send(row) accepts a single list or tuple of column values
+//=================================================================================
+static PyObject* python_bcp_object_sendrow(BCP_ConnectionObject* self, FASTCALL_PARAMETERS)
+{
+    PyObject* const* args_items;
+    Py_ssize_t args_count;
+    PyObject* row;
+
+    FASTCALL_ITEMS(args_items, args_count);
+
+    if (args_count != 1)
+    {
+        PyErr_SetString(BCP_ParameterError, "Invalid column data passed to send()");
+        return NULL;
+    }
+
+    row = args_items[0];
+
+    if (!PyList_Check(row) && !PyTuple_Check(row))
+    {
+        PyErr_SetString(PyExc_ValueError, "Must use a list or tuple for send()");
+        return NULL;
+    }
+
+    if (send_row_sequence(self, row) == -1)
+    {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+//=================================================================================
+//  RowWriter: a callable bound to a connection's bcp session that takes the
+//  column values directly as positional arguments, i.e. writer.write(a, b, c)
+//=================================================================================
+static PyObject* python_bcp_rowwriter_write(BCP_RowWriterObject* self, FASTCALL_PARAMETERS)
+{
+    PyObject* const* items;
+    Py_ssize_t count;
+
+    FASTCALL_ITEMS(items, count);
+
+    if (send_row_values(self->connection, items, count) == -1)
+    {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* python_bcp_rowwriter_writerow(BCP_RowWriterObject* self, PyObject* row)
+{
+    if (!PyList_Check(row) && !PyTuple_Check(row))
+    {
+        PyErr_SetString(PyExc_ValueError, "Must use a list or tuple for writerow()");
+        return NULL;
+    }
+
+    if (send_row_sequence(self->connection, row) == -1)
+    {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+#ifdef HAVE_VECTORCALL
+static PyObject* python_bcp_rowwriter_vectorcall(PyObject* callable, PyObject* const* args, size_t nargsf, PyObject* kwnames)
+{
+    if (kwnames != NULL && PyTuple_GET_SIZE(kwnames) > 0)
+    {
+        PyErr_SetString(BCP_ParameterError, "RowWriter only accepts positional column values");
+        return NULL;
+    }
+
+    if (send_row_values(((BCP_RowWriterObject*) callable)->connection, args, PyVectorcall_NARGS(nargsf)) == -1)
+    {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+#else
+static PyObject* python_bcp_rowwriter_call(BCP_RowWriterObject* self, PyObject* args, PyObject* kwargs)
+{
+    if (kwargs != NULL && PyDict_Size(kwargs) > 0)
+    {
+        PyErr_SetString(BCP_ParameterError, "RowWriter only accepts positional column values");
+        return NULL;
+    }
+
+    if (send_row_values(self->connection, &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args)) == -1)
+    {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+#endif
+
+static void python_bcp_rowwriter_delete(BCP_RowWriterObject* self)
+{
+    Py_XDECREF(self->connection);
+    PyObject_Del(self);
+}
+
+//=================================================================================
+//  Enable the encoded value cache for the given column positions (counting from
+//  0), each holding up to size distinct values. cache(None) turns it off.
+//=================================================================================
+static PyObject* python_bcp_object_cache(BCP_ConnectionObject* self, PyObject* args, PyObject* kwargs)
+{
+    static char *keywords[] = {"columns", "size", NULL};
+
+    PyObject* columns = Py_None;
+    PyObject* sequence;
+    Py_ssize_t* positions = NULL;
+    Py_ssize_t size = 1024;
+    Py_ssize_t count = 0;
+    Py_ssize_t total = 0;
+    Py_ssize_t index;
+    BCP_ColumnCache* caches;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|On", keywords, &columns, &size))
+    {
+        PyErr_SetString(BCP_ParameterError, "Invalid|incomplete parameters passed to cache()");
+        return NULL;
+    }
+
+    if (size < 1)
+    {
+        PyErr_SetString(BCP_ParameterError, "cache() size must be at least 1");
+        return NULL;
+    }
+
+    if (columns != Py_None)
+    {
+        // A tuple copy, as converting a position can run python code that changes a list
+        if ((sequence = PySequence_Tuple(columns)) == NULL)
+        {
+            if (PyErr_ExceptionMatches(PyExc_TypeError))
+            {
+                PyErr_SetString(PyExc_TypeError, "cache() columns must be a sequence of column positions");
+            }
+
+            return NULL;
+        }
+
+        total = PyTuple_GET_SIZE(sequence);
+
+        if ((positions = (Py_ssize_t*) malloc((total ? total : 1) * sizeof(Py_ssize_t))) == NULL)
+        {
+            Py_DECREF(sequence);
+            return PyErr_NoMemory();
+        }
+
+        for (index = 0; index < total; ++index)
+        {
+            Py_ssize_t position = PyNumber_AsSsize_t(PyTuple_GET_ITEM(sequence, index), PyExc_OverflowError);
+
+            if (position < 0)
+            {
+                Py_DECREF(sequence);
+                free(positions);
+
+                if (!PyErr_Occurred())
+                {
+                    PyErr_SetString(BCP_ParameterError, "cache() column positions count from 0");
+                }
+
+                return NULL;
+            }
+
+            positions[index] = position;
+            count = position + 1 > count ? position + 1 : count;
+        }
+
+        Py_DECREF(sequence);
+    }
+
+    if (count > self->cachecount)
+    {
+        if ((caches = (BCP_ColumnCache*) realloc(self->caches, count * sizeof(BCP_ColumnCache))) == NULL)
+        {
+            free(positions);
+            return PyErr_NoMemory();
+        }
+
+        memset(&caches[self->cachecount], 0, (count - self->cachecount) * sizeof(BCP_ColumnCache));
+        self->caches = caches;
+        self->cachecount = count;
+    }
+
+    for (index = 0; index < self->cachecount; ++index)
+    {
+        column_cache_clear(&self->caches[index]);
+    }
+
+    for (index = 0; index < total; ++index)
+    {
+        if (column_cache_init(&self->caches[positions[index]], size) == -1)
+        {
+            free(positions);
+            return NULL;
+        }
+    }
+
+    free(positions);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+//=================================================================================
+//     Report transfer counters, including the encoded value cache hit rates
+//=================================================================================
+static PyObject* python_bcp_object_stats(BCP_ConnectionObject* self, PyObject* args)
+{
+    PyObject* columns = PyDict_New();
+    PyObject* stats;
+    Py_ssize_t hits = 0;
+    Py_ssize_t misses = 0;
+    Py_ssize_t index;
+
+    for (index = 0; columns != NULL && index < self->cachecount; ++index)
+    {
+        BCP_ColumnCache* cache = &self->caches[index];
+        Py_ssize_t lookups = cache->hits + cache->misses;
+        PyObject* column;
+        PyObject* key;
+        int failed;
+
+        if (cache->entries == NULL)
+        {
+            continue;
+        }
+
+        hits += cache->hits;
+        misses += cache->misses;
+
+        column = Py_BuildValue("{s:n,s:n,s:d}", "hits", cache->hits, "misses", cache->misses, "hitrate", lookups ? (double) cache->hits / lookups : 0.0);
+        key = PyLong_FromSsize_t(index);
+        failed = column == NULL || key == NULL || PyDict_SetItem(columns, key, column) == -1;
+        Py_XDECREF(column);
+        Py_XDECREF(key);
+
+        if (failed)
+        {
+            Py_CLEAR(columns);
+        }
+    }
+
+    if (columns == NULL)
+    {
+        return NULL;
+    }
+
+    stats = Py_BuildValue
+    (
+        "{s:n,s:n,s:i,s:n,s:n,s:d,s:N}",
+        "rowcount", self->rowcount,
+        "batches", self->batches,
+        "packetsize", self->packetsize,
+        "cachehits", hits,
+        "cachemisses", misses,
+        "cachehitrate", hits + misses ? (double) hits / (hits + misses) : 0.0,
+        "cachecolumns", columns
+    );
+
+    return stats;
+}
+
+//=================================================================================
+//  Flush rows written with sendrow and commit transaction, then end bcp session
+//=================================================================================
+static PyObject* python_bcp_object_done(BCP_ConnectionObject* self, PyObject* args)
+{
+    DBINT rows;
+
+    if (connection_in_use(self))
+    {
+        return NULL;
+    }
+
+    lock_connection(self);
+    self->insession = 0;
+    self->batchrows = 0;
+    self->pendingbytes = 0;
+    rows = bcp_done(self->dbproc);
+    unlock_connection(self);
+
+    if (self->pendingerror[0] != '\0' && raise_deferred_errors(self) == -1) // From the latency timer
+    {
+        return NULL;
+    }
+
+    return Py_BuildValue("i", rows);
+}
+
+//=================================================================================
+//  Configure streaming mode: commit when any of batchsize rows, batchbytes bytes
+//  of column data or maxlatency seconds of waiting is reached, whichever is first
+//=================================================================================
+static PyObject* python_bcp_object_streaming(BCP_ConnectionObject* self, PyObject* args, PyObject* kwargs)
+{
+    static char *keywords[] = {"batchsize", "batchbytes", "maxlatency", NULL};
+
+    Py_ssize_t batchsize = self->batchsize;
+    Py_ssize_t batchbytes = 0;
+    double maxlatency = 0.0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|nnd", keywords, &batchsize, &batchbytes, &maxlatency))
+    {
+        PyErr_SetString(BCP_ParameterError, "Invalid|incomplete parameters passed to streaming()");
+        return NULL;
+    }
+
+    if (batchsize < 0 || batchbytes < 0 || maxlatency < 0.0)
+    {
+        PyErr_SetString(BCP_ParameterError, "streaming() limits can't be negative, use 0 to disable one");
+        return NULL;
+    }
+
+    if (maxlatency == 0.0)
+    {
+        stop_latency_timer(self);
+    }
+
+    lock_connection(self);
+    self->batchsize = batchsize;
+    self->batchbytes = batchbytes;
+    self->maxlatency = maxlatency;
+
+    if (self->timerrunning)
+    {
+        bcp_cond_broadcast(&self->timerwake); // Recompute the deadline
+    }
+
+    unlock_connection(self);
+
+    if (maxlatency > 0.0 && ! self->timerrunning)
+    {
+        self->timerstop = 0;
+
+        if (bcp_thread_start(&self->timer, latency_timer_thread, self) != 0)
+        {
+            PyErr_SetString(BCP_SessionError, "Couldn't start the streaming latency timer");
+            return NULL;
+        }
+
+        self->timerrunning = 1;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+//=================================================================================
+//          Create a RowWriter bound to the currently initialised session
+//=================================================================================
+static PyObject* python_bcp_object_writer(BCP_ConnectionObject* self, PyObject* args)
+{
+    BCP_RowWriterObject* writer;
+
+    if (! self->insession)
+    {
+        PyErr_SetString(BCP_SessionError, "No bcp session is active, call init() first");
+        return NULL;
+    }
+
+    if ((writer = PyObject_New(BCP_RowWriterObject, &BCP_RowWriterType)) == NULL)
+    {
+        return NULL;
+    }
+
+    Py_INCREF(self);
+    writer->connection = self;
+#ifdef HAVE_VECTORCALL
+    writer->vectorcall = python_bcp_rowwriter_vectorcall;
+#endif
+
+    return (PyObject*) writer;
+}
+
+//=================================================================================
+//   This method is unused and only exists to test the freetds connection
+//=================================================================================
+static PyObject* python_bcp_object_simple_query(BCP_ConnectionObject* self, PyObject* args, PyObject* kwargs)
+{
+    static char *keywords[] = {"query", "print_results", NULL};
+    int print_results = 0;
+    char* query = "select name from sysobjects";
+
+    int result = PyArg_ParseTupleAndKeywords(args, kwargs, "s|B", keywords, &query, &print_results);
+
+    if (! result)
+    {
+        PyErr_SetString(BCP_ParameterError, "No query passed to simplequery()");
+        return NULL;
+    }
+
+    if (connection_in_use(self))
+    {
+        return NULL;
+    }
+
+    lock_connection(self);
+    dbfcmd(self->dbproc, query);
+    dbsqlexec(self->dbproc);
+
+    if (PyErr_Occurred())
+    {
+        unlock_connection(self);
+        return NULL;
+    }
+
+    while (dbresults(self->dbproc) != NO_MORE_RESULTS)
+    {
+        int columns = dbnumcols(self->dbproc);
+
+        if (columns > 0 && print_results)
+        {
+            char fields[columns][8192];
+            int nulls[columns];
+            int row = 0;
+            int index;
+
+            printf("row");
+
+            for (index = 0; index < columns; ++index)
+            {
+                dbbind(self->dbproc, index + 1, NTBSTRINGBIND, sizeof(fields[index]), (BYTE *)fields[index]);
+                dbnullbind(self->dbproc, index + 1, &nulls[index]);
+                printf (",%s", dbcolname(self->dbproc, index + 1));
+            }
+
+            printf ("\n");
+
+            while (dbnextrow(self->dbproc) != NO_MORE_ROWS)
+            {
+                printf("%d", row++);
+
+                for (index = 0; index < columns; ++index)
+                {
+                    printf(",");
+
+                    if (nulls[index] == -1)
+                        printf ("null");
+                    else
+                        printf ("\"%s\"", fields [index]);
+                }
+
+                printf ("\n");
+            }
+        }
+
+        if (PyErr_Occurred())
+        {
+            unlock_connection(self);
+            return NULL;
+        }
+    }
+
+    unlock_connection(self);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+//=================================================================================
+//  Bounded queue of rows in native form, shared by one producer and one consumer
+//  thread. Slots are reused, so column buffers only grow to the widest value seen.
+//=================================================================================
+typedef struct
+{
+    bcp_mutex_t lock;
+    bcp_cond_t changed;
+    BCP_ColumnValue* values; // slots * columns
+    int columns;
+    int slots;
+    int head;
+    int count;
+    int finished; // Producer has no more rows
+    int aborted;  // Either side gave up, the other should stop
+} BCP_RowQueue;
+
+static int row_queue_init(BCP_RowQueue* queue, int slots, int columns)
+{
+    memset(queue, 0, sizeof(*queue));
+
+    if ((queue->values = (BCP_ColumnValue*) calloc((size_t) slots * columns, sizeof(BCP_ColumnValue))) == NULL)
+    {
+        return -1;
+    }
+
+    queue->slots = slots;
+    queue->columns = columns;
+    bcp_mutex_init(&queue->lock);
+    bcp_cond_init(&queue->changed);
+    return 0;
+}
+
+static void row_queue_destroy(BCP_RowQueue* queue)
+{
+    int index;
+
+    if (queue->values == NULL)
+    {
+        return;
+    }
+
+    for (index = 0; index < queue->slots * queue->columns; ++index)
+    {
+        free(queue->values[index].data);
+    }
+
+    free(queue->values);
+    queue->values = NULL;
+    bcp_cond_destroy(&queue->changed);
+    bcp_mutex_destroy(&queue->lock);
+}
+
+// Producer: wait for a free slot, NULL if the consumer has aborted
+static BCP_ColumnValue* row_queue_reserve(BCP_RowQueue* queue)
+{
+    BCP_ColumnValue* slot = NULL;
+
+    bcp_mutex_lock(&queue->lock);
+
+    while (queue->count == queue->slots && ! queue->aborted)
+    {
+        bcp_cond_wait(&queue->changed, &queue->lock);
+    }
+
+    if (! queue->aborted)
+    {
+        slot = &queue->values[((queue->head + queue->count) % queue->slots) * queue->columns];
+    }
+
+    bcp_mutex_unlock(&queue->lock);
+    return slot;
+}
+
+static void row_queue_publish(BCP_RowQueue* queue)
+{
+    bcp_mutex_lock(&queue->lock);
+    ++queue->count;
+    bcp_cond_broadcast(&queue->changed);
+    bcp_mutex_unlock(&queue->lock);
+}
+
+// Consumer: wait for a filled slot, NULL once the producer is finished or aborted
+static BCP_ColumnValue* row_queue_peek(BCP_RowQueue* queue)
+{
+    BCP_ColumnValue* slot = NULL;
+
+    bcp_mutex_lock(&queue->lock);
+
+    while (queue->count == 0 && ! queue->finished && ! queue->aborted)
+    {
+        bcp_cond_wait(&queue->changed, &queue->lock);
+    }
+
+    if (queue->count > 0 && ! queue->aborted)
+    {
+        slot = &queue->values[queue->head * queue->columns];
+    }
+
+    bcp_mutex_unlock(&queue->lock);
+    return slot;
+}
+
+static void row_queue_release(BCP_RowQueue* queue)
+{
+    bcp_mutex_lock(&queue->lock);
+    queue->head = (queue->head + 1) % queue->slots;
+    --queue->count;
+    bcp_cond_broadcast(&queue->changed);
+    bcp_mutex_unlock(&queue->lock);
+}
+
+static void row_queue_finish(BCP_RowQueue* queue, int aborted)
+{
+    bcp_mutex_lock(&queue->lock);
+    queue->finished = 1;
+    queue->aborted |= aborted;
+    bcp_cond_broadcast(&queue->changed);
+    bcp_mutex_unlock(&queue->lock);
+}
+
+//=================================================================================
+//  Table to table copy. A reader thread fetches the source query's rows into
+//  the queue while the calling thread bulk inserts them into the destination,
+//  both without the GIL. Values keep their native dblib representation.
+//=================================================================================
+typedef struct
+{
+    BCP_ConnectionObject* source;
+    BCP_RowQueue queue;
+    char failure[256]; // Failure detected by this module rather than dblib
+} BCP_CopyContext;
+
+BCP_THREAD_FUNCTION(copy_reader_thread, argument)
+{
+    BCP_CopyContext* context = (BCP_CopyContext*) argument;
+    DBPROCESS* dbproc = context->source->dbproc;
+    STATUS status;
+    int aborted = 0;
+    int index;
+
+    while ((status = dbnextrow(dbproc)) != NO_MORE_ROWS)
+    {
+        BCP_ColumnValue* slot;
+
+        if (status == FAIL || (slot = row_queue_reserve(&context->queue)) == NULL)
+        {
+            aborted = 1;
+            break;
+        }
+
+        for (index = 0; index < context->queue.columns; ++index)
+        {
+            BYTE* data = dbdata(dbproc, index + 1);
+
+            if (data == NULL)
+            {
+                slot[index].length = 0;
+                slot[index].null = 1;
+            }
+            else if (column_value_set(&slot[index], data, dbdatlen(dbproc, index + 1)) == -1)
+            {
+                snprintf(context->failure, sizeof(context->failure), "Couldn't allocate column data buffer");
+                aborted = 1;
+                break;
+            }
+        }
+
+        if (aborted)
+        {
+            break;
+        }
+
+        row_queue_publish(&context->queue);
+    }
+
+    if (aborted)
+    {
+        dbcancel(dbproc);
+    }
+    else
+    {
+        while (dbresults(dbproc) != NO_MORE_RESULTS); // Drain any trailing results
+    }
+
+    row_queue_finish(&context->queue, aborted);
+    BCP_THREAD_RETURN;
+}
+
+//=================================================================================
+//  Point a column at a queued value. dblib takes a length of 0 to mean NULL, so
+//  an empty value is bound as a terminated field that starts with its
+//  terminator. A column is rebound whenever it switches between the two forms.
+//=================================================================================
+static RETCODE bind_column_value(DBPROCESS* dbproc, const BCP_ColumnValue* value, int type, int position, int bound, int* terminated)
+{
+    static BYTE empty[] = "";
+
+    int empty_value = ! value->null && value->length == 0;
+    BYTE* data = value->length ? value->data : empty;
+    DBINT length = empty_value ? -1 : value->length;
+
+    if (! bound || empty_value != *terminated)
+    {
+        *terminated = empty_value;
+        return bcp_bind(dbproc, data, 0, length, empty_value ? empty : NULL, empty_value ? 1 : 0, type, position);
+    }
+
+    if (bcp_colptr(dbproc, data, position) == FAIL)
+    {
+        return FAIL;
+    }
+
+    return bcp_collen(dbproc, length, position);
+}
+
+static DBINT copy_writer(BCP_CopyContext* context, BCP_ConnectionObject* destination, const char* table, int* types, Py_ssize_t batchsize)
+{
+    DBPROCESS* dbproc = destination->dbproc;
+    BCP_ColumnValue* slot;
+    DBINT rows = 0;
+    Py_ssize_t batchrows = 0;
+    int* terminated;
+    int bound = 0;
+    int index;
+
+    if ((terminated = (int*) calloc(context->queue.columns, sizeof(int))) == NULL)
+    {
+        snprintf(context->failure, sizeof(context->failure), "Couldn't allocate column binding flags");
+        row_queue_finish(&context->queue, 1);
+        return -1;
+    }
+
+    if (bcp_init(dbproc, table, NULL, NULL, DB_IN) == FAIL)
+    {
+        snprintf(context->failure, sizeof(context->failure), "failed to create bcp session for the specified table");
+        row_queue_finish(&context->queue, 1);
+        free(terminated);
+        return -1;
+    }
+
+    while ((slot = row_queue_peek(&context->queue)) != NULL)
+    {
+        for (index = 0; index < context->queue.columns; ++index)
+        {
+            if (bind_column_value(dbproc, &slot[index], types[index], index + 1, bound, &terminated[index]) == FAIL)
+            {
+                snprintf(context->failure, sizeof(context->failure), "couldn't bind data for column %d", index + 1);
+                break;
+            }
+        }
+
+        if (index < context->queue.columns || bcp_sendrow(dbproc) == FAIL)
+        {
+            break;
+        }
+
+        bound = 1;
+        ++rows;
+        row_queue_release(&context->queue);
+
+        if (batchsize > 0 && ++batchrows >= batchsize)
+        {
+            if (bcp_batch(dbproc) == -1)
+            {
+                break;
+            }
+
+            batchrows = 0;
+        }
+    }
+
+    free(terminated);
+
+    if (slot != NULL || context->queue.aborted)
+    {
+        row_queue_finish(&context->queue, 1);
+        bcp_done(dbproc); // Batches already committed remain in the destination
+        return -1;
+    }
+
+    return bcp_done(dbproc) == -1 ? -1 : rows;
+}
+
+static PyObject* python_bcp_copy(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    static char *keywords[] = {"source", "query", "destination", "table", "batchsize", "bufferrows", NULL};
+
+    BCP_ConnectionObject* source;
+    BCP_ConnectionObject* destination;
+    const char* query;
+    const char* table;
+    Py_ssize_t batchsize = -1;
+    int bufferrows = 1024;
+
+    BCP_CopyContext context;
+    bcp_thread_t reader;
+    int* types = NULL;
+    int columns = 0;
+    int index;
+    int failed = 0;
+    int source_error;
+    DBINT rows = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!sO!s|ni", keywords, &BCP_ConnectionType, &source, &query, &BCP_ConnectionType, &destination, &table, &batchsize, &bufferrows))
+    {
+        PyErr_SetString(BCP_ParameterError, "Invalid|incomplete parameters passed to copy()");
+        return NULL;
+    }
+
+    if (source->dbproc == NULL || destination->dbproc == NULL || source == destination)
+    {
+        PyErr_SetString(BCP_ParameterError, "copy() needs two distinct connected Connection objects");
+        return NULL;
+    }
+
+    if (connection_in_use(source) || connection_in_use(destination))
+    {
+        return NULL;
+    }
+
+    if (source->insession || destination->insession)
+    {
+        PyErr_SetString(BCP_SessionError, "copy() can't run while a bcp session is active on either connection");
+        return NULL;
+    }
+
+    if (bufferrows < 1)
+    {
+        PyErr_SetString(BCP_ParameterError, "bufferrows must be at least 1");
+        return NULL;
+    }
+
+    if (batchsize < 0)
+    {
+        batchsize = destination->batchsize;
+    }
+
+    memset(&context, 0, sizeof(context));
+    context.source = source;
+
+    defer_connection_errors(source);
+    defer_connection_errors(destination);
+
+    Py_BEGIN_ALLOW_THREADS
+
+    if (dbcmd(source->dbproc, query) == FAIL || dbsqlexec(source->dbproc) == FAIL)
+    {
+        failed = 1;
+    }
+    else
+    {
+        RETCODE result;
+
+        // The first result set that has columns is the one copied
+        while ((result = dbresults(source->dbproc)) == SUCCEED && (columns = dbnumcols(source->dbproc)) == 0);
+
+        if (result != SUCCEED)
+        {
+            snprintf(context.failure, sizeof(context.failure), "copy() source query returned no result set");
+            failed = 1;
+        }
+    }
+
+    if (! failed)
+    {
+        if ((types = (int*) malloc(columns * sizeof(int))) == NULL || row_queue_init(&context.queue, bufferrows, columns) == -1)
+        {
+            snprintf(context.failure, sizeof(context.failure), "Couldn't allocate copy buffers");
+            dbcancel(source->dbproc);
+            failed = 1;
+        }
+    }
+
+    if (! failed)
+    {
+        for (index = 0; index < columns; ++index)
+        {
+            types[index] = dbcoltype(source->dbproc, index + 1);
+        }
+
+        if (bcp_thread_start(&reader, copy_reader_thread, &context) != 0)
+        {
+            snprintf(context.failure, sizeof(context.failure), "Couldn't start the copy reader thread");
+            dbcancel(source->dbproc);
+            failed = 1;
+        }
+        else
+        {
+            rows = copy_writer(&context, destination, table, types, batchsize);
+            bcp_thread_join(reader);
+            failed = rows == -1;
+        }
+    }
+
+    row_queue_destroy(&context.queue);
+    free(types);
+
+    Py_END_ALLOW_THREADS
+
+    source_error = raise_deferred_errors(source);
+
+    if (raise_deferred_errors(destination) == -1 || source_error == -1)
+    {
+        return NULL;
+    }
+
+    if (failed)
+    {
+        PyErr_SetString(BCP_DataError, context.failure[0] ? context.failure : "copy() failed");
+        return NULL;
+    }
+
+    destination->rowcount += rows;
+    return Py_BuildValue("i", (int) rows);
+}
+
+//=================================================================================
+//  Batched stored procedure calls. dbrpcsend() submits every queued RPC as a
+//  request of its own, so each batch is written as one language batch of EXEC
+//  statements instead and the server round trip is paid once per batch rather
+//  than per call. Parameter values become typed literals, output parameters are
+//  bound to variables declared in the batch, and each call ends with a select of
+//  its return status and outputs whose first column is named after the call.
+//=================================================================================
+#define BCP_CALL_COLUMN "bcp_call_"
+
+typedef struct
+{
+    char* text;
+    size_t length;
+    size_t capacity;
+} BCP_SqlText;
+
+static int sql_text_append(BCP_SqlText* sql, const char* text, size_t length)
+{
+    if (sql->length + length >= sql->capacity)
+    {
+        size_t capacity = sql->capacity ? sql->capacity : 4096;
+        char* grown;
+
+        while (sql->length + length >= capacity)
+        {
+            capacity *= 2;
+        }
+
+        if ((grown = (char*) realloc(sql->text, capacity)) == NULL)
+        {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        sql->text = grown;
+        sql->capacity = capacity;
+    }
+
+    memcpy(sql->text + sql->length, text, length);
+    sql->length += length;
+    sql->text[sql->length] = '\0';
+    return 0;
+}
+
+// Only for short fixed formats (numbers and generated names)
+static int sql_text_format(BCP_SqlText* sql, const char* format, ...)
+{
+    char text[128];
+    va_list arguments;
+    int length;
+
+    va_start(arguments, format);
+    length = vsnprintf(text, sizeof(text), format, arguments);
+    va_end(arguments);
+
+    if (length < 0 || length >= (int) sizeof(text))
+    {
+        PyErr_SetString(BCP_DataError, "Couldn't format remote procedure call text");
+        return -1;
+    }
+
+    return sql_text_append(sql, text, length);
+}
+
+static int rpc_is_integer(PyObject* value)
+{
+#ifndef IS_PY3K
+    return PyInt_Check(value) || PyLong_Check(value);
+#else
+    return PyLong_Check(value);
+#endif
+}
+
+//=================================================================================
+//   Write a parameter value as a T-SQL literal of its python type. Strings are
+//   written as N'' literals in the client charset, which FreeTDS converts along
+//   with the rest of the batch text.
+//=================================================================================
+static int rpc_append_literal(BCP_SqlText* sql, PyObject* value)
+{
+    PyObject* holder;
+    char* data;
+    Py_ssize_t size;
+    Py_ssize_t start;
+    Py_ssize_t index;
+    int failed;
+
+    if (value == Py_None)
+    {
+        return sql_text_append(sql, "NULL", 4);
+    }
+
+    if (PyBool_Check(value))
+    {
+        return sql_text_append(sql, value == Py_True ? "1" : "0", 1);
+    }
+
+    if (rpc_is_integer(value))
+    {
+        int overflow;
+        PY_LONG_LONG number = PyLong_AsLongLongAndOverflow(value, &overflow);
+
+        if (overflow || (number == -1 && PyErr_Occurred()))
+        {
+            PyErr_SetString(BCP_DataError, "Integer parameter doesn't fit in a bigint");
+            return -1;
+        }
+
+        return sql_text_format(sql, "%lld", (long long) number);
+    }
+
+    if (PyFloat_Check(value))
+    {
+        double number = PyFloat_AS_DOUBLE(value);
+
+        if (! Py_IS_FINITE(number))
+        {
+            PyErr_SetString(BCP_DataError, "Float parameters must be finite");
+            return -1;
+        }
+
+        return sql_text_format(sql, "%.16e", number); // The exponent makes it a float literal
+    }
+
+#ifdef IS_PY3K
+    if (PyBytes_Check(value))
+    {
+        static const char digits[] = "0123456789ABCDEF";
+        const unsigned char* bytes = (const unsigned char*) PyBytes_AS_STRING(value);
+        char hex[256];
+
+        if (sql_text_append(sql, "0x", 2) == -1)
+        {
+            return -1;
+        }
+
+        for (start = 0; start < PyBytes_GET_SIZE(value); start += sizeof(hex) / 2)
+        {
+            Py_ssize_t length = PyBytes_GET_SIZE(value) - start;
+
+            if (length > (Py_ssize_t) sizeof(hex) / 2)
+            {
+                length = sizeof(hex) / 2;
+            }
+
+            for (index = 0; index < length; ++index)
+            {
+                hex[2 * index] = digits[bytes[start + index] >> 4];
+                hex[2 * index + 1] = digits[bytes[start + index] & 0x0F];
+            }
+
+            if (sql_text_append(sql, hex, 2 * length) == -1)
+            {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+#endif
+
+    if (encode_column_value(value, &holder, &data, &size) == -1)
+    {
+        return -1;
+    }
+
+    if (memchr(data, '\0', size) != NULL)
+    {
+        Py_DECREF(holder);
+        PyErr_SetString(BCP_DataError, "String parameters can't contain NUL characters");
+        return -1;
+    }
+
+    failed = sql_text_append(sql, "N'", 2) == -1;
+
+    for (start = 0, index = 0; ! failed && index <= size; ++index)
+    {
+        if (index == size || data[index] == '\'')
+        {
+            failed = sql_text_append(sql, data + start, index - start) == -1 || (index < size && sql_text_append(sql, "''", 2) == -1);
+            start = index + 1;
+        }
+    }
+
+    Py_DECREF(holder);
+    return failed || sql_text_append(sql, "'", 1) == -1 ? -1 : 0;
+}
+
+// Declared type of the variable behind an output parameter
+static const char* rpc_variable_type(PyObject* value)
+{
+    if (PyBool_Check(value))
+    {
+        return "bit";
+    }
+
+    if (rpc_is_integer(value))
+    {
+        return "bigint";
+    }
+
+    if (PyFloat_Check(value))
+    {
+        return "float";
+    }
+
+#ifdef IS_PY3K
+    if (PyBytes_Check(value))
+    {
+        return "varbinary(8000)";
+    }
+#endif
+
+    return "nvarchar(4000)";
+}
+
+// A declared SQL type: a name with an optional (n), (max) or (p, s), nothing else
+static int rpc_valid_type(const char* text, Py_ssize_t size)
+{
+    Py_ssize_t index = 0;
+
+    if (size == 0 || size > 64 || ! isalpha((unsigned char) text[0]))
+    {
+        return 0;
+    }
+
+    while (index < size && (isalnum((unsigned char) text[index]) || text[index] == '_'))
+    {
+        ++index;
+    }
+
+    while (index < size && text[index] == ' ')
+    {
+        ++index;
+    }
+
+    if (index < size && text[index] == '(')
+    {
+        for (++index; index < size && text[index] != ')'; ++index)
+        {
+            if (! isdigit((unsigned char) text[index]) && strchr(", maxMAX", text[index]) == NULL)
+            {
+                return 0;
+            }
+        }
+
+        index += index < size; // The closing bracket
+        return index == size && text[index - 1] == ')';
+    }
+
+    return index == size;
+}
+
+//=================================================================================
+//   Output parameters by position or name, as a dict of declared SQL types (as
+//   bytes) owned by callmany(). Given a sequence, or None as a dict's type, the
+//   type is taken from each call's input value instead.
+//=================================================================================
+static PyObject* rpc_output_types(PyObject* outputs)
+{
+    PyObject* declared = PyDict_New();
+    PyObject* entries = PyDict_Check(outputs) ? PyDict_Items(outputs) : PySequence_List(outputs);
+    Py_ssize_t index;
+
+    for (index = 0; declared != NULL && entries != NULL && index < PyList_GET_SIZE(entries); ++index)
+    {
+        PyObject* entry = PyList_GET_ITEM(entries, index);
+        PyObject* key = PyDict_Check(outputs) ? PyTuple_GET_ITEM(entry, 0) : entry;
+        PyObject* type = PyDict_Check(outputs) ? PyTuple_GET_ITEM(entry, 1) : Py_None;
+        PyObject* text = Py_None;
+        PyObject* holder;
+        char* data;
+        Py_ssize_t size;
+
+        Py_INCREF(Py_None);
+
+        if (type != Py_None)
+        {
+            if (encode_column_value(type, &holder, &data, &size) == -1)
+            {
+                Py_CLEAR(declared);
+                break;
+            }
+
+            Py_DECREF(text);
+            text = rpc_valid_type(data, size) ? PyBytes_FromStringAndSize(data, size) : NULL;
+            Py_DECREF(holder);
+
+            if (text == NULL)
+            {
+                if (!PyErr_Occurred())
+                {
+                    PyErr_SetString(PyExc_ValueError, "callmany() output types must be SQL type names such as int, decimal(18, 4) or nvarchar(max)");
+                }
+
+                Py_CLEAR(declared);
+                break;
+            }
+        }
+
+        if (PyDict_SetItem(declared, key, text) == -1)
+        {
+            Py_CLEAR(declared);
+        }
+
+        Py_DECREF(text);
+    }
+
+    if (entries == NULL)
+    {
+        Py_CLEAR(declared);
+    }
+
+    Py_XDECREF(entries);
+    return declared;
+}
+
+// Named parameters are written into the batch as they are, so only plain names are accepted
+static int rpc_parameter_name(PyObject* key, PyObject** holder, char** name)
+{
+    Py_ssize_t size;
+    Py_ssize_t index;
+
+    if (encode_column_value(key, holder, name, &size) == -1)
+    {
+        return -1;
+    }
+
+    for (index = 1; index < size && (isalnum((unsigned char) (*name)[index]) || strchr("_@#$", (*name)[index]) != NULL); ++index);
+
+    if (size < 2 || (*name)[0] != '@' || index < size)
+    {
+        Py_DECREF(*holder);
+        PyErr_SetString(PyExc_ValueError, "callmany() parameter names must be of the form @name");
+        return -1;
+    }
+
+    return 0;
+}
+
+//=================================================================================
+//   Write a procedure name, optionally qualified (server.database.schema.name),
+//   with every part bracket quoted, so the name can't carry other SQL. Parts may
+//   already be in brackets, and may be empty as in database..name.
+//=================================================================================
+static int rpc_quote_procedure(const char* procedure, BCP_SqlText* sql)
+{
+    char name[256];
+    char quoted[520];
+    const char* cursor = procedure;
+    int parts = 0;
+
+    for (;;)
+    {
+        size_t length = 0;
+        int valid = 1;
+
+        if (*cursor == '[')
+        {
+            for (++cursor; *cursor && ! (*cursor == ']' && cursor[1] != ']'); ++cursor)
+            {
+                if (*cursor == ']')
+                {
+                    ++cursor; // A doubled closing bracket stands for one
+                }
+
+                valid = valid && length < sizeof(name) - 1;
+                name[valid ? length++ : 0] = *cursor;
+            }
+
+            valid = valid && *cursor++ == ']' && length > 0;
+        }
+        else
+        {
+            for (; *cursor && (isalnum((unsigned char) *cursor) || (unsigned char) *cursor >= 0x80 || strchr("_@#$", *cursor) != NULL); ++cursor)
+            {
+                valid = valid && length < sizeof(name) - 1;
+                name[valid ? length++ : 0] = *cursor;
+            }
+        }
+
+        name[valid ? length : 0] = '\0';
+
+        if (! valid || ++parts > 4 || (*cursor != '.' && *cursor != '\0') || (*cursor == '\0' && length == 0))
+        {
+            PyErr_SetString(PyExc_ValueError, "callmany() procedure must be a name such as dbo.usp_price");
+            return -1;
+        }
+
+        if (length > 0 && (quote_sql_identifier(name, quoted, sizeof(quoted)) == -1 || sql_text_append(sql, quoted, strlen(quoted)) == -1))
+        {
+            if (!PyErr_Occurred())
+            {
+                PyErr_SetString(PyExc_ValueError, "callmany() procedure name is too long");
+            }
+
+            return -1;
+        }
+
+        if (*cursor == '\0')
+        {
+            return 0;
+        }
+
+        ++cursor;
+
+        if (sql_text_append(sql, ".", 1) == -1)
+        {
+            return -1;
+        }
+    }
+}
+
+//=================================================================================
+//   Append one call; the row is either a sequence of positional parameter values
+//   or a dict of parameter names (e.g. "@id") to values. Call numbers start at 1
+//   in each batch.
+//=================================================================================
+static int rpc_append_call(BCP_SqlText* sql, const char* procedure, int call, PyObject* row, PyObject* outputs)
+{
+    PyObject* stack[BCP_ROW_STACK_ITEMS];
+    const char* types[BCP_ROW_STACK_ITEMS];
+    PyObject* const* items;
+    PyObject* pairs = NULL;
+    const char** output = types; // Declared type of each output parameter, NULL for inputs
+    Py_ssize_t count;
+    Py_ssize_t index;
+    int failed = 0;
+
+    if (PyDict_Check(row))
+    {
+        // A snapshot of the (name, value) pairs, as converting values can change the dict
+        if ((pairs = PyDict_Items(row)) == NULL)
+        {
+            return -1;
+        }
+
+        items = PySequence_Fast_ITEMS(pairs);
+        count = PyList_GET_SIZE(pairs);
+    }
+    else if (PyList_Check(row) || PyTuple_Check(row))
+    {
+        if ((items = row_items_acquire(row, stack, &count)) == NULL)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        PyErr_SetString(PyExc_ValueError, "callmany() parameter rows must be lists, tuples or dicts");
+        return -1;
+    }
+
+    if (count > BCP_ROW_STACK_ITEMS && (output = (const char**) malloc(count * sizeof(const char*))) == NULL)
+    {
+        PyErr_NoMemory();
+        failed = 1;
+    }
+
+    for (index = 0; ! failed && index < count; ++index)
+    {
+        PyObject* key = pairs ? PyTuple_GET_ITEM(items[index], 0) : PyLong_FromSsize_t(index);
+        PyObject* type = key && outputs ? PyDict_GetItem(outputs, key) : NULL; // Borrowed from callmany()'s own dict
+        PyObject* value = pairs ? PyTuple_GET_ITEM(items[index], 1) : items[index];
+
+        if (pairs == NULL)
+        {
+            Py_XDECREF(key);
+        }
+
+        failed = key == NULL;
+        output[index] = type == NULL ? NULL : type == Py_None ? rpc_variable_type(value) : PyBytes_AS_STRING(type);
+    }
+
+    // declare @bcp_status_1 int, @bcp_output_1_2 bigint; set @bcp_output_1_2 = 5;
+    failed = failed || sql_text_format(sql, "declare @bcp_status_%d int", call) == -1;
+
+    for (index = 0; ! failed && index < count; ++index)
+    {
+        if (output[index])
+        {
+            failed = sql_text_format(sql, ", @bcp_output_%d_%d %s", call, (int) index, output[index]) == -1;
+        }
+    }
+
+    failed = failed || sql_text_append(sql, ";\n", 2) == -1;
+
+    for (index = 0; ! failed && index < count; ++index)
+    {
+        PyObject* value = pairs ? PyTuple_GET_ITEM(items[index], 1) : items[index];
+
+        if (output[index] && value != Py_None)
+        {
+            failed = sql_text_format(sql, "set @bcp_output_%d_%d = ", call, (int) index) == -1 || rpc_append_literal(sql, value) == -1 || sql_text_append(sql, ";\n", 2) == -1;
+        }
+    }
+
+    // exec @bcp_status_1 = procedure 1, @bcp_output_1_2 output
+    failed = failed || sql_text_format(sql, "exec @bcp_status_%d = ", call) == -1 || sql_text_append(sql, procedure, strlen(procedure)) == -1;
+
+    for (index = 0; ! failed && index < count; ++index)
+    {
+        failed = sql_text_append(sql, index ? ", " : " ", index ? 2 : 1) == -1;
+
+        if (! failed && pairs)
+        {
+            PyObject* holder;
+            char* name;
+
+            failed = rpc_parameter_name(PyTuple_GET_ITEM(items[index], 0), &holder, &name) == -1;
+
+            if (! failed)
+            {
+                failed = sql_text_append(sql, name, strlen(name)) == -1 || sql_text_append(sql, " = ", 3) == -1;
+                Py_DECREF(holder);
+            }
+        }
+
+        if (! failed && output[index])
+        {
+            failed = sql_text_format(sql, "@bcp_output_%d_%d output", call, (int) index) == -1;
+        }
+        else if (! failed)
+        {
+            failed = rpc_append_literal(sql, pairs ? PyTuple_GET_ITEM(items[index], 1) : items[index]) == -1;
+        }
+    }
+
+    // select @bcp_status_1 as bcp_call_1, @bcp_output_1_2
+    failed = failed || sql_text_format(sql, ";\nselect @bcp_status_%d as " BCP_CALL_COLUMN "%d", call, call) == -1;
+
+    for (index = 0; ! failed && index < count; ++index)
+    {
+        if (output[index])
+        {
+            failed = sql_text_format(sql, ", @bcp_output_%d_%d", call, (int) index) == -1;
+        }
+    }
+
+    failed = failed || sql_text_append(sql, ";\n", 2) == -1;
+
+    if (output != types)
+    {
+        free((void*) output);
+    }
+
+    if (pairs)
+    {
+        Py_DECREF(pairs);
+    }
+    else
+    {
+        row_items_release(row, items, stack, count);
+    }
+
+    return failed ? -1 : 0;
+}
+
+//=================================================================================
+//              Convert a column of the current row to a python value
+//=================================================================================
+static PyObject* rpc_column_value(DBPROCESS* dbproc, int column)
+{
+    BYTE* data = dbdata(dbproc, column);
+    int length = dbdatlen(dbproc, column);
+    int type = dbcoltype(dbproc, column);
+    char text[256];
+    DBINT converted;
+
+    if (data == NULL)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    switch (type)
+    {
+        case SYBBIT:
+            return PyBool_FromLong(*data);
+        case SYBINT1:
+            return PyLong_FromLong(*(unsigned char*) data);
+        case SYBINT2:
+            return PyLong_FromLong(*(DBSMALLINT*) data);
+        case SYBINT4:
+            return PyLong_FromLong(*(DBINT*) data);
+        case SYBINT8:
+            return PyLong_FromLongLong(*(DBBIGINT*) data);
+        case SYBFLT8:
+            return PyFloat_FromDouble(*(DBFLT8*) data);
+        case SYBREAL:
+            return PyFloat_FromDouble(*(float*) data);
+        case SYBCHAR:
+        case SYBVARCHAR:
+        case SYBTEXT:
+#ifdef IS_PY3K
+            return PyUnicode_DecodeUTF8((const char*) data, length, "replace");
+#else
+            return PyString_FromStringAndSize((const char*) data, length);
+#endif
+        case SYBBINARY:
+        case SYBVARBINARY:
+        case SYBIMAGE:
+#ifdef IS_PY3K
+            return PyBytes_FromStringAndSize((const char*) data, length);
+#else
+            return PyString_FromStringAndSize((const char*) data, length);
+#endif
+    }
+
+    // Anything else (dates, money, numerics) comes back as its character form
+    if ((converted = dbconvert(dbproc, type, data, length, SYBCHAR, (BYTE*) text, sizeof(text) - 1)) < 0)
+    {
+        PyErr_SetString(BCP_DataError, "Couldn't convert returned parameter value");
+        return NULL;
+    }
+
+#ifdef IS_PY3K
+    return PyUnicode_DecodeUTF8(text, converted, "replace");
+#else
+    return PyString_FromStringAndSize(text, converted);
+#endif
+}
+
+// The call a result set reports on, or 0 when it is one of the procedure's own
+static int rpc_call_number(DBPROCESS* dbproc, Py_ssize_t calls)
+{
+    const char* name = dbcolname(dbproc, 1);
+    long call;
+
+    if (name == NULL || strncmp(name, BCP_CALL_COLUMN, sizeof(BCP_CALL_COLUMN) - 1) != 0)
+    {
+        return 0;
+    }
+
+    call = atol(name + sizeof(BCP_CALL_COLUMN) - 1);
+    return call > 0 && call <= calls ? (int) call : 0;
+}
+
+static int rpc_store_call(DBPROCESS* dbproc, Py_ssize_t position, PyObject* statuses, PyObject* outputs)
+{
+    int columns = dbnumcols(dbproc);
+    PyObject* status = rpc_column_value(dbproc, 1);
+    PyObject* values = status ? PyTuple_New(columns - 1) : NULL;
+    int index;
+
+    for (index = 2; values != NULL && index <= columns; ++index)
+    {
+        PyObject* value = rpc_column_value(dbproc, index);
+
+        if (value == NULL)
+        {
+            Py_CLEAR(values);
+            break;
+        }
+
+        PyTuple_SET_ITEM(values, index - 2, value);
+    }
+
+    if (values == NULL)
+    {
+        Py_XDECREF(status);
+        return -1;
+    }
+
+    PyList_SetItem(statuses, position, status);
+    PyList_SetItem(outputs, position, values);
+    return 0;
+}
+
+// Record a server message against the call it was raised in, keeping the first
+static int rpc_store_error(PyObject* errors, Py_ssize_t position, const char* message)
+{
+    PyObject* text;
+
+    if (PyList_GET_ITEM(errors, position) != Py_None)
+    {
+        return 0;
+    }
+
+#ifdef IS_PY3K
+    text = PyUnicode_DecodeUTF8(message, strlen(message), "replace");
+#else
+    text = PyString_FromString(message);
+#endif
+
+    return text == NULL ? -1 : PyList_SetItem(errors, position, text);
+}
+
+//=================================================================================
+// Send a batch of calls and read their results, releasing the GIL while waiting.
+// Result sets the procedures produce are discarded. Each call's return status,
+// output parameters and first server error are appended to the statuses,
+// outputs and errors lists; calls that never report back (e.g. a missing
+// procedure) leave None for their status and outputs. A failing call doesn't
+// stop the batch, every result is read so no call is cancelled part way.
+// *completed is the number of calls known to have finished, in all batches.
+//=================================================================================
+static int rpc_execute_batch(BCP_ConnectionObject* self, const char* sql, int calls, PyObject* statuses, PyObject* outputs, PyObject* errors, Py_ssize_t* completed)
+{
+    Py_ssize_t first = PyList_GET_SIZE(statuses);
+    RETCODE result = SUCCEED;
+    char failure[sizeof(self->pendingerror)] = "";
+    int reported = 0; // Highest call number whose results have been read
+    int stored = 1;   // Cleared once a python value can't be built, results are still read to the end
+    int sent;
+    int dead = 0;
+    int index;
+
+    for (index = 0; index < calls; ++index)
+    {
+        if (PyList_Append(statuses, Py_None) == -1 || PyList_Append(outputs, Py_None) == -1 || PyList_Append(errors, Py_None) == -1)
+        {
+            return -1;
+        }
+    }
+
+    defer_connection_errors(self);
+    Py_BEGIN_ALLOW_THREADS
+
+    // A failing first statement is reported against call 1 like any other
+    if ((sent = dbcmd(self->dbproc, (char*) sql) != FAIL && dbsqlsend(self->dbproc) != FAIL))
+    {
+        dbsqlok(self->dbproc);
+    }
+
+    Py_END_ALLOW_THREADS
+
+    while (sent && ! dead)
+    {
+        STATUS row = NO_MORE_ROWS;
+        int call = 0;
+
+        Py_BEGIN_ALLOW_THREADS
+
+        if ((result = dbresults(self->dbproc)) == SUCCEED && dbnumcols(self->dbproc) > 0)
+        {
+            call = rpc_call_number(self->dbproc, calls);
+            row = dbnextrow(self->dbproc);
+        }
+        else if (result == FAIL)
+        {
+            dead = DBDEAD(self->dbproc);
+        }
+
+        Py_END_ALLOW_THREADS
+
+        if (self->pendingerror[0] != '\0')
+        {
+            snprintf(failure, sizeof(failure), "%s", self->pendingerror);
+
+            if (stored && rpc_store_error(errors, first + (reported < calls ? reported : calls - 1), self->pendingerror) == -1)
+            {
+                stored = 0;
+            }
+
+            self->pendingerror[0] = '\0';
+        }
+
+        if (result == NO_MORE_RESULTS)
+        {
+            break;
+        }
+
+        if (call > 0 && row == REG_ROW && stored && rpc_store_call(self->dbproc, first + call - 1, statuses, outputs) == -1)
+        {
+            stored = 0;
+        }
+
+        reported = call > reported ? call : reported;
+
+        Py_BEGIN_ALLOW_THREADS
+
+        while (row != NO_MORE_ROWS && row != FAIL)
+        {
+            row = dbnextrow(self->dbproc); // Discard any further rows
+        }
+
+        Py_END_ALLOW_THREADS
+    }
+
+    self->nogil = 0;
+    self->pendingerror[0] = '\0';
+    *completed = first + (sent && ! dead ? calls : reported);
+
+    if (! sent || dead)
+    {
+        if (stored || !PyErr_Occurred())
+        {
+            PyErr_SetString(BCP_DblibError, failure[0] ? failure : "Stored procedure call batch failed");
+        }
+
+        return -1;
+    }
+
+    return stored ? 0 : -1;
+}
+
+//=================================================================================
+// Leave the results gathered so far on the exception being raised, as batches
+// sent before it, and calls of the failing batch, may already have run. Only the
+// first completed entries of the lists are final.
+//=================================================================================
+static void attach_call_results(Py_ssize_t completed, PyObject* statuses, PyObject* outputs, PyObject* errors)
+{
+    PyObject* type;
+    PyObject* value;
+    PyObject* traceback;
+    PyObject* count = PyLong_FromSsize_t(completed);
+
+    PyErr_Fetch(&type, &value, &traceback);
+    PyErr_NormalizeException(&type, &value, &traceback);
+
+    if (value != NULL && count != NULL)
+    {
+        if (PyObject_SetAttrString(value, "completed", count) == -1 || PyObject_SetAttrString(value, "statuses", statuses) == -1 || PyObject_SetAttrString(value, "outputs", outputs) == -1 || PyObject_SetAttrString(value, "errors", errors) == -1)
+        {
+            PyErr_Clear();
+        }
+    }
+
+    Py_XDECREF(count);
+    PyErr_Restore(type, value, traceback);
+}
+
+static PyObject* python_bcp_object_callmany(BCP_ConnectionObject* self, PyObject* args, PyObject* kwargs)
+{
+    static char *keywords[] = {"procedure", "rows", "outputs", "batchsize", NULL};
+
+    const char* procedure;
+    PyObject* rows;
+    PyObject* outputs = NULL;
+    Py_ssize_t batchsize = 1000;
+
+    BCP_SqlText sql = {NULL, 0, 0};
+    BCP_SqlText name = {NULL, 0, 0};
+    PyObject* iterator = NULL;
+    PyObject* statuses = NULL;
+    PyObject* returned = NULL;
+    PyObject* errors = NULL;
+    PyObject* row = NULL;
+    Py_ssize_t completed = 0;
+    int failed = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sO|On", keywords, &procedure, &rows, &outputs, &batchsize))
+    {
+        PyErr_SetString(BCP_ParameterError, "Invalid|incomplete parameters passed to callmany()");
+        return NULL;
+    }
+
+    if (outputs == Py_None)
+    {
+        outputs = NULL;
+    }
+
+    if (connection_in_use(self))
+    {
+        return NULL;
+    }
+
+    if (self->dbproc == NULL || self->insession)
+    {
+        PyErr_SetString(BCP_SessionError, "callmany() needs a connection with no active bcp session");
+        return NULL;
+    }
+
+    if (batchsize < 1 || batchsize > 1000000)
+    {
+        PyErr_SetString(BCP_ParameterError, "batchsize must be between 1 and 1000000");
+        return NULL;
+    }
+
+    if (rpc_quote_procedure(procedure, &name) == -1)
+    {
+        free(name.text);
+        return NULL;
+    }
+
+    if (outputs && (outputs = rpc_output_types(outputs)) == NULL)
+    {
+        free(name.text);
+        return NULL;
+    }
+
+    if ((iterator = PyObject_GetIter(rows)) == NULL || (statuses = PyList_New(0)) == NULL || (returned = PyList_New(0)) == NULL || (errors = PyList_New(0)) == NULL)
+    {
+        Py_XDECREF(iterator);
+        Py_XDECREF(statuses);
+        Py_XDECREF(returned);
+        Py_XDECREF(outputs);
+        free(name.text);
+        return NULL;
+    }
+
+    while (! failed)
+    {
+        int calls = 0;
+
+        sql.length = 0;
+
+        while (calls < batchsize && (row = PyIter_Next(iterator)) != NULL)
+        {
+            failed = rpc_append_call(&sql, name.text, ++calls, row, outputs) == -1;
+            Py_DECREF(row);
+
+            if (failed)
+            {
+                break;
+            }
+        }
+
+        if (failed || PyErr_Occurred() || calls == 0)
+        {
+            failed = failed || PyErr_Occurred() != NULL;
+            break;
+        }
+
+        failed = rpc_execute_batch(self, sql.text, calls, statuses, returned, errors, &completed) == -1;
+    }
+
+    free(sql.text);
+    free(name.text);
+    Py_XDECREF(iterator);
+    Py_XDECREF(outputs);
+
+    if (failed)
+    {
+        attach_call_results(completed, statuses, returned, errors);
+        Py_DECREF(statuses);
+        Py_DECREF(returned);
+        Py_DECREF(errors);
+        return NULL;
+    }
+
+    return Py_BuildValue("(NNN)", statuses, returned, errors);
+}
+
+//=================================================================================
+//  Partitioned loading. Each row is routed, by its partition column value and
+//  the target's partition function boundaries, to a staging table for that
+//  partition. Every staging table is loaded by copy_writer() on a connection and
+//  thread of its own, fed through a row queue. done() checks that every staging
+//  table only holds rows of its own partition, then switches the staged
+//  partitions into the target in a single transaction, which is metadata only.
+//=================================================================================
+#define python_bcp_staging_name "%(table)s_stage_%(partition)d"
+
+// Create a staging table partitioned on the target's scheme, with the same
+// clustered index as the target (or as a heap, when the target is one). Names
+// within N'...' literals use their %(..._literal)s forms, with quotes doubled.
+#define python_bcp_staging_prepare "\
+select * into %(staging)s from %(table)s where 1 = 0;\n\
+declare @keys nvarchar(max), @unique nvarchar(16), @scheme nvarchar(600);\n\
+set @scheme = quotename(N'%(scheme_literal)s') + N'(' + quotename(N'%(column_literal)s') + N')';\n\
+select @unique = case when is_unique = 1 then N'unique ' else N'' end from sys.indexes where object_id = object_id(N'%(table_literal)s') and index_id = 1;\n\
+set @keys = stuff((select N', ' + quotename(c.name) + case when ic.is_descending_key = 1 then N' desc' else N'' end from sys.index_columns ic join sys.columns c on c.object_id = ic.object_id and c.column_id = ic.column_id where ic.object_id = object_id(N'%(table_literal)s') and ic.index_id = 1 and ic.key_ordinal > 0 order by ic.key_ordinal for xml path('')), 1, 2, N'');\n\
+exec (N'create ' + coalesce(@unique, N'') + N'clustered index staging_key on %(staging_literal)s (' + coalesce(@keys, quotename(N'%(column_literal)s')) + N') on ' + @scheme);\n\
+if @keys is null exec (N'drop index staging_key on %(staging_literal)s with (move to ' + @scheme + N')');\n\
+"
+
+enum
+{
+    partition_key_text = 0, // Compared as bytes, i.e. in binary collation order
+    partition_key_integer = 1,
+    partition_key_real = 2,
+    partition_key_datetime = 3
+};
+
+typedef struct
+{
+    BCP_CopyContext context; // Only the queue and failure text are used
+    BCP_ConnectionObject* connection;
+    bcp_thread_t thread;
+    int* types;
+    Py_ssize_t batchsize;
+    int partition;
+    int running;
+    DBINT rows;
+    char staging[1024];
+} BCP_PartitionWorker;
+
+typedef struct
+{
+    PyObject_HEAD
+    BCP_ConnectionObject* control; // Reads the catalog and performs the switches
+    PyObject* options;  // Connection keyword arguments, reused for every worker
+    PyObject* staging;  // Staging table name template
+    PyObject* prepare;  // SQL template that creates a staging table
+    char table[1024];
+    char column[256];
+    char scheme[256];
+    int keytype;
+    int keyposition;    // Position of the partition column in a row, from 0
+    int rangeright;     // Boundary values belong to the partition on their right
+    int columns;
+    int* types;
+    BCP_ColumnValue key;
+    BCP_ColumnValue* boundaries;
+    int boundarycount;
+    BCP_PartitionWorker** workers; // Per partition, started when its first row arrives
+    int partitions;
+    int bufferrows;
+    int finished;
+    int busy;           // In send() or done(), which can give up the GIL
+    Py_ssize_t rowcount;
+} BCP_PartitionedLoaderObject;
+
+BCP_THREAD_FUNCTION(partition_worker_thread, argument)
+{
+    BCP_PartitionWorker* worker = (BCP_PartitionWorker*) argument;
+
+    worker->rows = copy_writer(&worker->context, worker->connection, worker->staging, worker->types, worker->batchsize);
+    BCP_THREAD_RETURN;
+}
+
+//=================================================================================
+//  Convert the character form of a partition column value, as sent to the server,
+//  into a key that compares the way the server orders the column. Zero length
+//  keys stand for NULL, which sorts below every boundary.
+//=================================================================================
+static int partition_key_convert(DBPROCESS* dbproc, int keytype, const BYTE* text, DBINT length, BCP_ColumnValue* key)
+{
+    int type;
+    DBINT size;
+
+    switch (keytype)
+    {
+        case partition_key_integer:
+            type = SYBINT8;
+            size = sizeof(DBBIGINT);
+            break;
+
+        case partition_key_real:
+            type = SYBFLT8;
+            size = sizeof(DBFLT8);
+            break;
+
+        case partition_key_datetime:
+            type = SYBDATETIME;
+            size = sizeof(DBDATETIME);
+            break;
+
+        default:
+            return column_value_set(key, text, length);
+    }
+
+    if (length == 0)
+    {
+        key->length = 0;
+        return 0;
+    }
+
+    if (column_value_reserve(key, size) == -1 || dbconvert(dbproc, SYBCHAR, (BYTE*) text, length, type, key->data, size) != size)
+    {
+        return -1;
+    }
+
+    key->length = size;
+    return 0;
+}
+
+static int partition_key_compare(int keytype, const BCP_ColumnValue* left, const BCP_ColumnValue* right)
+{
+    if (left->length == 0 || right->length == 0)
+    {
+        return (left->length != 0) - (right->length != 0);
+    }
+
+    switch (keytype)
+    {
+        case partition_key_integer:
+        {
+            DBBIGINT a, b;
+
+            memcpy(&a, left->data, sizeof(a));
+            memcpy(&b, right->data, sizeof(b));
+            return (a > b) - (a < b);
+        }
+
+        case partition_key_real:
+        {
+            DBFLT8 a, b;
+
+            memcpy(&a, left->data, sizeof(a));
+            memcpy(&b, right->data, sizeof(b));
+            return (a > b) - (a < b);
+        }
+
+        case partition_key_datetime:
+        {
+            DBDATETIME a, b;
+
+            memcpy(&a, left->data, sizeof(a));
+            memcpy(&b, right->data, sizeof(b));
+
+            if (a.dtdays != b.dtdays)
+            {
+                return (a.dtdays > b.dtdays) - (a.dtdays < b.dtdays);
+            }
+
+            return (a.dttime > b.dttime) - (a.dttime < b.dttime);
+        }
+
+        default:
+        {
+            int order = memcmp(left->data, right->data, left->length < right->length ? left->length : right->length);
+
+            return order ? order : (left->length > right->length) - (left->length < right->length);
+        }
+    }
+}
+
+//=================================================================================
+//  Partition number (from 1) for a key. With RANGE LEFT a boundary value is the
+//  last in its partition, with RANGE RIGHT it is the first of the next one.
+//=================================================================================
+static int partition_of_key(BCP_PartitionedLoaderObject* self, const BCP_ColumnValue* key)
+{
+    int low = 0;
+    int high = self->boundarycount;
+
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        int order = partition_key_compare(self->keytype, &self->boundaries[middle], key);
+
+        if (order < 0 || (order == 0 && self->rangeright))
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return low + 1;
+}
+
+//=================================================================================
+//   Run a batch of SQL statements on a connection and discard any results
+//=================================================================================
+static int run_statements(BCP_ConnectionObject* connection, const char* sql)
+{
+    if (dbcmd(connection->dbproc, (char*) sql) == FAIL || dbsqlexec(connection->dbproc) == FAIL)
+    {
+        while (dbresults(connection->dbproc) != NO_MORE_RESULTS);
+
+        if (!PyErr_Occurred())
+        {
+            PyErr_SetString(BCP_DblibError, "Couldn't execute SQL statements");
+        }
+
+        return -1;
+    }
+
+    while (dbresults(connection->dbproc) != NO_MORE_RESULTS)
+    {
+        while (dbnextrow(connection->dbproc) != NO_MORE_ROWS);
+    }
+
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+// As run_statements(), without the GIL, for batches that can run for a while
+static int run_statements_released(BCP_ConnectionObject* connection, const char* sql)
+{
+    RETCODE result;
+
+    defer_connection_errors(connection);
+
+    Py_BEGIN_ALLOW_THREADS
+
+    if ((result = dbcmd(connection->dbproc, (char*) sql)) != FAIL)
+    {
+        result = dbsqlexec(connection->dbproc);
+    }
+
+    while (dbresults(connection->dbproc) != NO_MORE_RESULTS)
+    {
+        while (dbnextrow(connection->dbproc) != NO_MORE_ROWS);
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (raise_deferred_errors(connection) == -1)
+    {
+        return -1;
+    }
+
+    if (result == FAIL)
+    {
+        PyErr_SetString(BCP_DblibError, "Couldn't execute SQL statements");
+        return -1;
+    }
+
+    return 0;
+}
+
+//=================================================================================
+//  Read the partition column, scheme, range direction and boundary values of the
+//  target table from the SQL Server catalog
+//=================================================================================
+static int read_partition_function(BCP_PartitionedLoaderObject* self)
+{
+    DBPROCESS* dbproc = self->control->dbproc;
+    char query[4096];
+    char table[1024];
+    char column[512];
+    DBINT details[4] = {-1, 0, 0, 0};
+    int result_set = 0;
+    STATUS status;
+
+    if (quote_sql_literal(self->table, table, sizeof(table)) == -1 || quote_sql_literal(self->column, column, sizeof(column)) == -1)
+    {
+        PyErr_SetString(BCP_ParameterError, "PartitionedLoader() table or column name is too long");
+        return -1;
+    }
+
+    snprintf
+    (
+        query,
+        sizeof(query),
+        "select ps.name, pf.boundary_value_on_right, "
+            "(select count(*) from sys.columns where object_id = c.object_id and column_id < c.column_id), "
+            "(select count(*) from sys.columns where object_id = c.object_id), "
+            "case when t.name in ('tinyint', 'smallint', 'int', 'bigint') then %d "
+            "when t.name in ('real', 'float', 'decimal', 'numeric', 'money', 'smallmoney') then %d "
+            "when t.name in ('date', 'datetime', 'datetime2', 'smalldatetime') then %d else %d end "
+        "from sys.indexes i "
+        "join sys.partition_schemes ps on ps.data_space_id = i.data_space_id "
+        "join sys.partition_functions pf on pf.function_id = ps.function_id "
+        "join sys.index_columns ic on ic.object_id = i.object_id and ic.index_id = i.index_id and ic.partition_ordinal = 1 "
+        "join sys.columns c on c.object_id = ic.object_id and c.column_id = ic.column_id "
+        "join sys.types t on t.user_type_id = c.system_type_id "
+        "where i.object_id = object_id('%s') and i.index_id in (0, 1) and c.name = '%s'\n"
+        "select case "
+            "when sql_variant_property(prv.value, 'BaseType') in ('date', 'datetime', 'datetime2', 'smalldatetime') "
+                "then convert(nvarchar(64), convert(datetime2(3), prv.value), 121) "
+            "when sql_variant_property(prv.value, 'BaseType') in ('real', 'float') "
+                "then convert(nvarchar(64), convert(float, prv.value), 2) "
+            "else convert(nvarchar(4000), prv.value) end "
+        "from sys.indexes i "
+        "join sys.partition_schemes ps on ps.data_space_id = i.data_space_id "
+        "join sys.partition_range_values prv on prv.function_id = ps.function_id "
+        "where i.object_id = object_id('%s') and i.index_id in (0, 1) "
+        "order by prv.boundary_id",
+        partition_key_integer,
+        partition_key_real,
+        partition_key_datetime,
+        partition_key_text,
+        table,
+        column,
+        table
+    );
+
+    if (dbcmd(dbproc, query) == FAIL || dbsqlexec(dbproc) == FAIL)
+    {
+        while (dbresults(dbproc) != NO_MORE_RESULTS);
+
+        if (!PyErr_Occurred())
+        {
+            PyErr_SetString(BCP_DblibError, "Couldn't read the partition function from the catalog");
+        }
+
+        return -1;
+    }
+
+    while (dbresults(dbproc) != NO_MORE_RESULTS)
+    {
+        if (dbnumcols(dbproc) == 0)
+        {
+            continue;
+        }
+
+        if (result_set++ == 0)
+        {
+            dbbind(dbproc, 1, NTBSTRINGBIND, sizeof(self->scheme), (BYTE*) self->scheme);
+            dbbind(dbproc, 2, INTBIND, sizeof(DBINT), (BYTE*) &details[3]);
+            dbbind(dbproc, 3, INTBIND, sizeof(DBINT), (BYTE*) &details[0]);
+            dbbind(dbproc, 4, INTBIND, sizeof(DBINT), (BYTE*) &details[1]);
+            dbbind(dbproc, 5, INTBIND, sizeof(DBINT), (BYTE*) &details[2]);
+            while (dbnextrow(dbproc) != NO_MORE_ROWS);
+            continue;
+        }
+
+        while ((status = dbnextrow(dbproc)) == REG_ROW)
+        {
+            BCP_ColumnValue* boundaries = (BCP_ColumnValue*) realloc(self->boundaries, (self->boundarycount + 1) * sizeof(BCP_ColumnValue));
+
+            if (boundaries == NULL)
+            {
+                dbcancel(dbproc);
+                PyErr_NoMemory();
+                return -1;
+            }
+
+            self->boundaries = boundaries;
+            memset(&boundaries[self->boundarycount], 0, sizeof(BCP_ColumnValue));
+
+            if (partition_key_convert(dbproc, details[2], dbdata(dbproc, 1), dbdatlen(dbproc, 1), &boundaries[self->boundarycount++]) == -1)
+            {
+                dbcancel(dbproc);
+
+                if (!PyErr_Occurred())
+                {
+                    PyErr_SetString(BCP_DataError, "Couldn't convert a partition boundary value");
+                }
+
+                return -1;
             }
-            else if ((field_data[index] = (unsigned char*) malloc(field_sizes[index] + 1)) == NULL)
+        }
+    }
+
+    if (PyErr_Occurred())
+    {
+        return -1;
+    }
+
+    if (details[0] < 0)
+    {
+        PyErr_Format(BCP_ParameterError, "%s is not partitioned on column %s", self->table, self->column);
+        return -1;
+    }
+
+    self->keyposition = details[0];
+    self->columns = details[1];
+    self->keytype = details[2];
+    self->rangeright = details[3];
+    self->partitions = self->boundarycount + 1;
+    return 0;
+}
+
+//=================================================================================
+//  Add text to a template's values as key, and with its quotes doubled for use
+//  within a string literal as key_literal
+//=================================================================================
+static int set_template_text(PyObject* values, const char* key, const char* text)
+{
+    size_t size = 2 * strlen(text) + 2;
+    char* quoted = (char*) malloc(size);
+    char name[64];
+    PyObject* value;
+    int result = -1;
+
+    if (quoted == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    snprintf(name, sizeof(name), "%s_literal", key);
+    quote_sql_literal(text, quoted, size);
+
+    if ((value = Py_BuildValue("s", quoted)) != NULL)
+    {
+        result = PyDict_SetItemString(values, name, value);
+        Py_DECREF(value);
+    }
+
+    free(quoted);
+
+    if (result == 0)
+    {
+        result = (value = Py_BuildValue("s", text)) == NULL ? -1 : PyDict_SetItemString(values, key, value);
+        Py_XDECREF(value);
+    }
+
+    return result;
+}
+
+//=================================================================================
+//  Create the staging table for a partition, connect to the server for it and
+//  start the thread that bulk loads it
+//=================================================================================
+static BCP_PartitionWorker* start_partition_worker(BCP_PartitionedLoaderObject* self, int partition)
+{
+    BCP_PartitionWorker* worker;
+    PyObject* values;
+    PyObject* staging = NULL;
+    PyObject* prepare = NULL;
+    PyObject* arguments = NULL;
+    PyObject* holder = NULL;
+    char* text;
+    Py_ssize_t length;
+    int started = 0;
+
+    if ((worker = (BCP_PartitionWorker*) calloc(1, sizeof(BCP_PartitionWorker))) == NULL)
+    {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    worker->partition = partition;
+    worker->types = self->types;
+
+    values = Py_BuildValue("{s:i}", "partition", partition);
+
+    if (values != NULL && (set_template_text(values, "table", self->table) == -1 || set_template_text(values, "scheme", self->scheme) == -1 || set_template_text(values, "column", self->column) == -1))
+    {
+        Py_CLEAR(values);
+    }
+
+    if (values != NULL)
+    {
+#ifdef IS_PY3K
+        staging = PyUnicode_Format(self->staging, values);
+#else
+        staging = PyString_Format(self->staging, values);
+#endif
+    }
+
+    if (staging != NULL && encode_column_value(staging, &holder, &text, &length) == 0)
+    {
+        snprintf(worker->staging, sizeof(worker->staging), "%s", text);
+        Py_CLEAR(holder);
+
+        if (set_template_text(values, "staging", worker->staging) == 0)
+        {
+#ifdef IS_PY3K
+            prepare = PyUnicode_Format(self->prepare, values);
+#else
+            prepare = PyString_Format(self->prepare, values);
+#endif
+        }
+    }
+
+    if (prepare != NULL && (arguments = PyTuple_New(0)) != NULL)
+    {
+        worker->connection = (BCP_ConnectionObject*) PyObject_Call((PyObject*) &BCP_ConnectionType, arguments, self->options);
+    }
+
+    if (worker->connection != NULL && encode_column_value(prepare, &holder, &text, &length) == 0 && run_statements(worker->connection, text) == 0)
+    {
+        if (row_queue_init(&worker->context.queue, self->bufferrows, self->columns) == -1)
+        {
+            PyErr_NoMemory();
+        }
+        else
+        {
+            worker->batchsize = worker->connection->batchsize;
+            defer_connection_errors(worker->connection);
+
+            if (bcp_thread_start(&worker->thread, partition_worker_thread, worker) != 0)
             {
-                PyErr_SetString(BCP_DataError, "Couldn't allocate column data buffer");
+                worker->connection->nogil = 0;
+                PyErr_SetString(BCP_SessionError, "Couldn't start a partition loader thread");
             }
             else
             {
-                memset(field_data[index], 0, field_sizes[index] + 1);
-                memcpy(field_data[index], ptr, field_sizes[index]);
+                worker->running = 1;
+                started = 1;
+            }
+        }
+    }
+
+    Py_XDECREF(holder);
+    Py_XDECREF(arguments);
+    Py_XDECREF(prepare);
+    Py_XDECREF(staging);
+    Py_XDECREF(values);
+
+    if (! started)
+    {
+        row_queue_destroy(&worker->context.queue);
+        Py_XDECREF(worker->connection);
+        free(worker);
+        return NULL;
+    }
+
+    return worker;
+}
+
+//=================================================================================
+//  Wait for a worker's thread to end, aborting its load unless it finished
+//  normally, then report why it failed if it did
+//=================================================================================
+static int stop_partition_worker(BCP_PartitionWorker* worker, int aborted)
+{
+    if (worker->running)
+    {
+        row_queue_finish(&worker->context.queue, aborted);
+
+        Py_BEGIN_ALLOW_THREADS
+        bcp_thread_join(worker->thread);
+        Py_END_ALLOW_THREADS
+
+        worker->running = 0;
+    }
+
+    if (raise_deferred_errors(worker->connection) == -1 || aborted)
+    {
+        return -1;
+    }
+
+    if (worker->rows == -1)
+    {
+        if (!PyErr_Occurred())
+        {
+            PyErr_Format(BCP_DataError, "Loading %s failed: %s", worker->staging, worker->context.failure[0] ? worker->context.failure : "bcp error");
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+static void free_partition_workers(BCP_PartitionedLoaderObject* self)
+{
+    int index;
+
+    for (index = 0; self->workers != NULL && index < self->partitions; ++index)
+    {
+        BCP_PartitionWorker* worker = self->workers[index];
+
+        if (worker != NULL)
+        {
+            if (worker->running)
+            {
+                PyObject *type, *value, *traceback;
+
+                PyErr_Fetch(&type, &value, &traceback);
+                stop_partition_worker(worker, 1);
+                PyErr_Restore(type, value, traceback);
+            }
+
+            row_queue_destroy(&worker->context.queue);
+            Py_XDECREF(worker->connection);
+            free(worker);
+            self->workers[index] = NULL;
+        }
+    }
+}
+
+//=================================================================================
+//  send() and done() give up the GIL while waiting for loader threads, so a call
+//  from another thread then finds the loader busy rather than sharing its queues
+//=================================================================================
+static int loader_in_use(BCP_PartitionedLoaderObject* self)
+{
+    if (self->busy)
+    {
+        PyErr_SetString(BCP_SessionError, "PartitionedLoader is in use by another call");
+        return 1;
+    }
+
+    return 0;
+}
+
+//=================================================================================
+//  Route a row's column values to the staging load of its partition
+//=================================================================================
+static int loader_send_values(BCP_PartitionedLoaderObject* self, PyObject* const* items)
+{
+    PyObject* holder = NULL;
+    BCP_PartitionWorker* worker;
+    BCP_ColumnValue* slot;
+    char* text = NULL;
+    Py_ssize_t length = 0;
+    int partition;
+    int full;
+    int index;
+
+    if (items[self->keyposition] != Py_None && encode_column_value(items[self->keyposition], &holder, &text, &length) == -1)
+    {
+        return -1;
+    }
+
+    if (partition_key_convert(self->control->dbproc, self->keytype, (BYTE*) text, (DBINT) length, &self->key) == -1)
+    {
+        Py_XDECREF(holder);
+
+        if (!PyErr_Occurred())
+        {
+            PyErr_SetString(BCP_DataError, "Couldn't convert the partition column value");
+        }
+
+        return -1;
+    }
+
+    Py_XDECREF(holder);
+    partition = partition_of_key(self, &self->key);
+
+    if ((worker = self->workers[partition - 1]) == NULL && (worker = self->workers[partition - 1] = start_partition_worker(self, partition)) == NULL)
+    {
+        return -1;
+    }
+
+    bcp_mutex_lock(&worker->context.queue.lock);
+    full = worker->context.queue.count == worker->context.queue.slots;
+    bcp_mutex_unlock(&worker->context.queue.lock);
+
+    if (full) // Only give up the GIL when there is a wait for the loader thread
+    {
+        Py_BEGIN_ALLOW_THREADS
+        slot = row_queue_reserve(&worker->context.queue);
+        Py_END_ALLOW_THREADS
+    }
+    else
+    {
+        slot = row_queue_reserve(&worker->context.queue);
+    }
+
+    if (slot == NULL)
+    {
+        stop_partition_worker(worker, 0);
+
+        if (!PyErr_Occurred())
+        {
+            PyErr_Format(BCP_DataError, "Loading %s stopped", worker->staging);
+        }
+
+        return -1;
+    }
+
+    for (index = 0; index < self->columns; ++index)
+    {
+        if (items[index] == Py_None)
+        {
+            slot[index].length = 0;
+            slot[index].null = 1;
+        }
+        else if (encode_column_value(items[index], &holder, &text, &length) == -1)
+        {
+            return -1;
+        }
+        else
+        {
+            int failed = column_value_set(&slot[index], (BYTE*) text, (DBINT) length);
+
+            Py_DECREF(holder);
+
+            if (failed)
+            {
+                PyErr_NoMemory();
+                return -1;
             }
+        }
+    }
+
+    row_queue_publish(&worker->context.queue);
+    ++self->rowcount;
+    return 0;
+}
+
+//=================================================================================
+//  send(row) accepts a single list or tuple of column values. A list's values are
+//  held until the row is queued, since encoding them can run code that changes it.
+//=================================================================================
+static PyObject* python_bcp_loader_send(BCP_PartitionedLoaderObject* self, FASTCALL_PARAMETERS)
+{
+    PyObject* const* args_items;
+    Py_ssize_t args_count;
+    PyObject* stack[BCP_ROW_STACK_ITEMS];
+    PyObject* const* items;
+    PyObject* row;
+    Py_ssize_t count;
+    int failed;
+
+    FASTCALL_ITEMS(args_items, args_count);
+
+    if (args_count != 1 || (!PyList_Check(args_items[0]) && !PyTuple_Check(args_items[0])))
+    {
+        PyErr_SetString(PyExc_ValueError, "Must use a list or tuple for send()");
+        return NULL;
+    }
+
+    if (loader_in_use(self))
+    {
+        return NULL;
+    }
+
+    if (self->finished)
+    {
+        PyErr_SetString(BCP_SessionError, "PartitionedLoader is finished");
+        return NULL;
+    }
+
+    row = args_items[0];
+
+    if (PySequence_Fast_GET_SIZE(row) != self->columns)
+    {
+        PyErr_Format(BCP_DataError, "Rows for %s need %d column values", self->table, self->columns);
+        return NULL;
+    }
+
+    if ((items = row_items_acquire(row, stack, &count)) == NULL)
+    {
+        return NULL;
+    }
+
+    self->busy = 1;
+    failed = loader_send_values(self, items);
+    self->busy = 0;
+    row_items_release(row, items, stack, count);
+
+    if (failed)
+    {
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+//=================================================================================
+//  Finish every staging load, then switch the staged partitions into the target
+//  and drop the staging tables. Returns the number of rows loaded.
+//=================================================================================
+static PyObject* loader_finish(BCP_PartitionedLoaderObject* self)
+{
+    char staging[2048];
+    size_t size = 512;
+    size_t position;
+    char* sql;
+    int failed = 0;
+    int index;
+
+    if (self->finished)
+    {
+        PyErr_SetString(BCP_SessionError, "PartitionedLoader is finished");
+        return NULL;
+    }
 
-            Py_XDECREF(str);
+    self->finished = 1;
+
+    for (index = 0; index < self->partitions; ++index)
+    {
+        if (self->workers[index] != NULL)
+        {
+            row_queue_finish(&self->workers[index]->context.queue, failed);
+            size += 8 * strlen(self->workers[index]->staging) + strlen(self->table) + 420;
         }
+    }
 
-        if (! PyErr_Occurred())
+    for (index = 0; index < self->partitions; ++index)
+    {
+        if (self->workers[index] != NULL && stop_partition_worker(self->workers[index], failed) == -1)
         {
-            if (bind_as_null)
-            {
-                if (self->rowcount == 0) // Must bind before first sendrow
-                {
-                    if (bcp_bind(self->dbproc, nullstr, 0, 0, nullstr, 0, SYBVARCHAR, bcp_column_position) == FAIL)
-                    {
-                        PyErr_SetString(BCP_DataError, "Can't bind column as NULL");
-                    }
-                }
-                else
-                {
-                    if (bcp_colptr(self->dbproc, nullstr, bcp_column_position) == FAIL) // Map to NULL data
-                    {
-                        PyErr_SetString(BCP_DataError, "call to bcp_colptr() for null column failed");
-                    }
-                    else if (bcp_collen(self->dbproc, 0, bcp_column_position) == FAIL) // Map to zero length
-                    {
-                        PyErr_SetString(BCP_DataError, "call to bcp_collen() for null column failed");
-                    }
-                }
-            }
-            else if (field_data[index])
-            {
-                unsigned char* column_data = (unsigned char*) field_data[index];
-                int column_width = field_sizes[index]; // strlen((char*) column_data);
+            failed = 1; // The first failure is the one raised, staging tables are kept
+        }
+    }
 
-                if (self->rowcount == 0) // Must bind before first sendrow
-                {
-                    if (bcp_bind(self->dbproc, column_data, 0, column_width, nullstr, 0, SYBVARCHAR, bcp_column_position) == FAIL)
-                    {
-                        PyErr_SetString(BCP_DataError, "call to bcp_bind() failed");
-                    }
-                }
-                else
-                {
-                    // fprintf(stderr, ",[%s]", column_data);
+    if (failed || (sql = (char*) malloc(size)) == NULL)
+    {
+        free_partition_workers(self);
+        return failed ? NULL : PyErr_NoMemory();
+    }
 
-                    if (bcp_colptr(self->dbproc, column_data, bcp_column_position) == FAIL)
-                    {
-                        PyErr_SetString(BCP_DataError, "call to bcp_colptr() column as string failed");
-                    }
-                    else if (bcp_collen(self->dbproc, column_width, bcp_column_position) == FAIL)
-                    {
-                        PyErr_SetString(BCP_DataError, "call to bcp_collen() for column as string failed");
-                    }
-                }
-            }
-            else
+    // Rows are routed by the client's reading of the boundaries, but the server
+    // places them, so a staging table can hold rows of other partitions. Only
+    // partition n of stage n is switched in, so any such rows stop the load
+    // before anything is switched, with every staging table kept. The staging
+    // tables share the target's scheme, so partition row counts show this
+    // without reading the rows.
+    position = snprintf(sql, size, "set xact_abort on;\n");
+
+    for (index = 0; index < self->partitions; ++index)
+    {
+        BCP_PartitionWorker* worker = self->workers[index];
+
+        if (worker != NULL)
+        {
+            if (quote_sql_literal(worker->staging, staging, sizeof(staging)) == -1)
             {
-                PyErr_SetString(BCP_DataError, "Couldn't get copy of column data");
+                free(sql);
+                free_partition_workers(self);
+                PyErr_SetString(BCP_ParameterError, "PartitionedLoader() staging table name is too long");
+                return NULL;
             }
+
+            position += snprintf
+            (
+                sql + position,
+                size - position,
+                "if exists (select 1 from sys.partitions where object_id = object_id(N'%s') and index_id in (0, 1) and partition_number <> %d and rows > 0)\n"
+                "begin\n"
+                "    raiserror(N'%%s holds rows outside partition %%d, no partition was switched and the staging tables are kept', 16, 1, N'%s', %d);\n"
+                "    return;\n"
+                "end;\n",
+                staging,
+                worker->partition,
+                staging,
+                worker->partition
+            );
         }
     }
 
-    // fprintf(stderr, "\n");
-    // fflush(stderr);
+    // Switch every partition or none, so the target never shows a partial load.
+    // xact_abort also ends the batch on failure, keeping the staging tables.
+    position += snprintf(sql + position, size - position, "begin transaction;\n");
 
-    if (! PyErr_Occurred())
+    for (index = 0; index < self->partitions; ++index)
     {
-        if (bcp_sendrow(self->dbproc) == FAIL && ! PyErr_Occurred())
-        {
-            PyErr_SetString(BCP_DataError, "Failed during bcp_sendrow()");
-        }
-        else if (self->batchsize == 0 || ++self->batchrows < self->batchsize)
-        {
-            // Don't do bcp_batch until we hit batchsize
-            // Remember, batchsize can be changed by the client, so don't
-            // try to use modulo arithmetic on rowcount instead
-        }
-        else if (bcp_batch(self->dbproc) == -1)
-        {
-            PyErr_SetString(BCP_DataError, "Failed during bcp_batch()");
-        }
-        else
+        BCP_PartitionWorker* worker = self->workers[index];
+
+        if (worker != NULL)
         {
-            self->batchrows = 0;
+            position += snprintf(sql + position, size - position, "alter table %s switch partition %d to %s partition %d;\n", worker->staging, worker->partition, self->table, worker->partition);
         }
     }
 
-    // ============================================
-    // Free up the fields used for the sendrow data
-    // ============================================
-    for (index = 0; index < self->rowsize; ++index)
+    position += snprintf(sql + position, size - position, "commit transaction;\n");
+
+    // A staging table that still holds rows is never dropped
+    for (index = 0; index < self->partitions; ++index)
     {
-        if (field_data[index] != NULL)
+        if (self->workers[index] != NULL)
         {
-            free(field_data[index]);
+            position += snprintf(sql + position, size - position, "if not exists (select 1 from %s) drop table %s;\n", self->workers[index]->staging, self->workers[index]->staging);
         }
     }
 
-    if (field_sizes != NULL) free(field_sizes);
-    if (field_data != NULL) free(field_data);
+    free_partition_workers(self);
+    failed = run_statements_released(self->control, sql);
+    free(sql);
 
-    if (PyErr_Occurred())
+    if (failed)
     {
         return NULL;
     }
 
-    ++self->rowcount;
-    Py_INCREF(Py_None);
-    return Py_None;
+    return Py_BuildValue("n", self->rowcount);
 }
 
-//=================================================================================
-//  Flush rows written with sendrow and commit transaction, then end bcp session
-//=================================================================================
-static PyObject* python_bcp_object_done(BCP_ConnectionObject* self, PyObject* args)
+static PyObject* python_bcp_loader_done(BCP_PartitionedLoaderObject* self, PyObject* args)
 {
-    return Py_BuildValue("i", bcp_done(self->dbproc));
+    PyObject* result;
+
+    if (loader_in_use(self))
+    {
+        return NULL;
+    }
+
+    self->busy = 1;
+    result = loader_finish(self);
+    self->busy = 0;
+    return result;
 }
 
 //=================================================================================
-//   This method is unused and only exists to test the freetds connection
+//  PartitionedLoader(table, partition_column, bufferrows=1024, staging=...,
+//  prepare=..., **connection parameters). Every other keyword is passed on to
+//  Connection() for the catalog connection and for each staging connection.
 //=================================================================================
-static PyObject* python_bcp_object_simple_query(BCP_ConnectionObject* self, PyObject* args, PyObject* kwargs)
+static int python_bcp_loader_init(BCP_PartitionedLoaderObject* self, PyObject* args, PyObject* kwargs)
 {
-    static char *keywords[] = {"query", "print_results", NULL};
-    int print_results = 0;
-    char* query = "select name from sysobjects";
+    static char *keywords[] = {"table", "partition_column", "bufferrows", "staging", "prepare", NULL};
 
-    int result = PyArg_ParseTupleAndKeywords(args, kwargs, "s|B", keywords, &query, &print_results);
+    PyObject* own = PyDict_New();
+    PyObject* arguments = PyTuple_New(0);
+    const char* table;
+    const char* column;
+    int index;
 
-    if (! result)
+    if (self->control != NULL)
     {
-        PyErr_SetString(BCP_ParameterError, "No query passed to simplequery()");
-        return NULL;
+        Py_XDECREF(own);
+        Py_XDECREF(arguments);
+        PyErr_SetString(BCP_SessionError, "PartitionedLoader is already initialised");
+        return -1;
     }
 
-    dbfcmd(self->dbproc, query);
-    dbsqlexec(self->dbproc);
+    self->options = kwargs ? PyDict_Copy(kwargs) : PyDict_New();
 
-    if (PyErr_Occurred())
+    if (own == NULL || arguments == NULL || self->options == NULL)
     {
-        return NULL;
+        Py_XDECREF(own);
+        Py_XDECREF(arguments);
+        return -1;
     }
 
-    while (dbresults(self->dbproc) != NO_MORE_RESULTS)
+    for (index = 0; keywords[index] != NULL; ++index) // Split the loader's own keywords out
     {
-        int columns = dbnumcols(self->dbproc);
+        PyObject* value = PyDict_GetItemString(self->options, keywords[index]);
 
-        if (columns > 0 && print_results)
+        if (value != NULL && (PyDict_SetItemString(own, keywords[index], value) == -1 || PyDict_DelItemString(self->options, keywords[index]) == -1))
         {
-            char fields[columns][8192];
-            int nulls[columns];
-            int row = 0;
-            int index;
+            Py_DECREF(own);
+            Py_DECREF(arguments);
+            return -1;
+        }
+    }
 
-            printf("row");
+    if (!PyArg_ParseTupleAndKeywords(args, own, "ss|iOO", keywords, &table, &column, &self->bufferrows, &self->staging, &self->prepare))
+    {
+        self->staging = self->prepare = NULL;
+        Py_DECREF(own);
+        Py_DECREF(arguments);
+        PyErr_SetString(BCP_ParameterError, "Invalid|incomplete parameters passed to PartitionedLoader()");
+        return -1;
+    }
 
-            for (index = 0; index < columns; ++index)
-            {
-                dbbind(self->dbproc, index + 1, NTBSTRINGBIND, sizeof(fields[index]), (BYTE *)fields[index]);
-                dbnullbind(self->dbproc, index + 1, &nulls[index]);
-                printf (",%s", dbcolname(self->dbproc, index + 1));
-            }
+    Py_XINCREF(self->staging);
+    Py_XINCREF(self->prepare);
+    Py_DECREF(own);
 
-            printf ("\n");
+    if (self->staging == NULL)
+    {
+        self->staging = Py_BuildValue("s", python_bcp_staging_name);
+    }
 
-            while (dbnextrow(self->dbproc) != NO_MORE_ROWS)
-            {
-                printf("%d", row++);
+    if (self->prepare == NULL)
+    {
+        self->prepare = Py_BuildValue("s", python_bcp_staging_prepare);
+    }
 
-                for (index = 0; index < columns; ++index)
-                {
-                    printf(",");
+    if (self->staging == NULL || self->prepare == NULL)
+    {
+        Py_DECREF(arguments);
+        return -1;
+    }
 
-                    if (nulls[index] == -1)
-                        printf ("null");
-                    else
-                        printf ("\"%s\"", fields [index]);
-                }
+    if (self->bufferrows < 1)
+    {
+        Py_DECREF(arguments);
+        PyErr_SetString(BCP_ParameterError, "bufferrows must be at least 1");
+        return -1;
+    }
 
-                printf ("\n");
-            }
-        }
+    snprintf(self->table, sizeof(self->table), "%s", table);
+    snprintf(self->column, sizeof(self->column), "%s", column);
 
-        if (PyErr_Occurred())
-        {
-            return NULL;
-        }
+    self->control = (BCP_ConnectionObject*) PyObject_Call((PyObject*) &BCP_ConnectionType, arguments, self->options);
+    Py_DECREF(arguments);
+
+    if (self->control == NULL || read_partition_function(self) == -1)
+    {
+        return -1;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    self->types = (int*) malloc(self->columns * sizeof(int));
+    self->workers = (BCP_PartitionWorker**) calloc(self->partitions, sizeof(BCP_PartitionWorker*));
+
+    if (self->types == NULL || self->workers == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (index = 0; index < self->columns; ++index)
+    {
+        self->types[index] = SYBVARCHAR; // Character data in the client charset, as with send()
+    }
+
+    return 0;
+}
+
+static PyObject* python_bcp_loader_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    BCP_PartitionedLoaderObject* self = (BCP_PartitionedLoaderObject*)type->tp_alloc(type, 0);
+
+    if (self)
+    {
+        self->control = NULL;
+        self->options = NULL;
+        self->staging = NULL;
+        self->prepare = NULL;
+        self->types = NULL;
+        self->boundaries = NULL;
+        self->boundarycount = 0;
+        self->workers = NULL;
+        self->partitions = 0;
+        self->bufferrows = 1024;
+        self->finished = 0;
+        self->busy = 0;
+        self->rowcount = 0;
+        memset(&self->key, 0, sizeof(self->key));
+    }
+
+    return (PyObject*) self;
+}
+
+static void python_bcp_loader_delete(BCP_PartitionedLoaderObject* self)
+{
+    int index;
+
+    free_partition_workers(self); // Unfinished loads are abandoned, staging tables remain
+
+    for (index = 0; index < self->boundarycount; ++index)
+    {
+        free(self->boundaries[index].data);
+    }
+
+    free(self->boundaries);
+    free(self->key.data);
+    free(self->types);
+    free(self->workers);
+    Py_XDECREF(self->control);
+    Py_XDECREF(self->options);
+    Py_XDECREF(self->staging);
+    Py_XDECREF(self->prepare);
+
+    Py_TYPE(self)->tp_free(self);
 }
 
 //=================================================================================
@@ -692,6 +4346,26 @@ static PyObject* python_bcp_object_new(PyTypeObject* type, PyObject* args, PyObj
         self->batchrows = 0;
         self->rowcount = 0;
         self->rowsize = 0;
+        self->packetsize = 0;
+        self->nodelay = 1;
+        self->sndbufrequest = 0;
+        self->sndbuf = 0;
+        self->insession = 0;
+        self->bound = 0;
+        self->nogil = 0;
+        self->pendingerror[0] = '\0';
+        self->batchbytes = 0;
+        self->maxlatency = 0.0;
+        self->pendingbytes = 0;
+        self->oldestpending = 0.0;
+        self->batches = 0;
+        self->timerrunning = 0;
+        self->timerstop = 0;
+        self->timerbusy = 0;
+        bcp_mutex_init(&self->lock);
+        bcp_cond_init(&self->timerwake);
+        self->caches = NULL;
+        self->cachecount = 0;
         self->dbproc = NULL;
     }
 
@@ -701,7 +4375,22 @@ static PyObject* python_bcp_object_new(PyTypeObject* type, PyObject* args, PyObj
 static void python_bcp_object_delete(BCP_ConnectionObject* self)
 {
     python_bcp_object_disconnect(self, Py_None);
-    // NIL
+
+    if (self->caches != NULL)
+    {
+        Py_ssize_t index;
+
+        for (index = 0; index < self->cachecount; ++index)
+        {
+            column_cache_clear(&self->caches[index]);
+        }
+
+        free(self->caches);
+    }
+
+    bcp_cond_destroy(&self->timerwake);
+    bcp_mutex_destroy(&self->lock);
+
     Py_TYPE(self)->tp_free(self);
     //self->ob_type->tp_free((PyObject*) self);
 }
@@ -712,6 +4401,7 @@ static void python_bcp_object_delete(BCP_ConnectionObject* self)
 static PyMethodDef python_bcp_methods[] = {
     {"use_interfaces", (PYFUNCTION_CAST)python_bcp_use_interfaces, METH_VARARGS|METH_KEYWORDS, "Select interfaces file to use"},
     {"logging", (PYFUNCTION_CAST)python_bcp_logging, METH_VARARGS|METH_KEYWORDS, "Start or stop logging"},
+    {"copy", (PYFUNCTION_CAST)python_bcp_copy, METH_VARARGS|METH_KEYWORDS, "Stream a query's rows from one connection into a table on another"},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -722,11 +4412,16 @@ static PyMethodDef python_bcp_object_methods[] = {
     {"connect", (PYFUNCTION_CAST)python_bcp_object_connect, METH_KEYWORDS|METH_VARARGS, "Connect to server"},
     {"disconnect", (PYFUNCTION_CAST)python_bcp_object_disconnect, METH_VARARGS, "Disconnect from server"},
     {"init", (PYFUNCTION_CAST)python_bcp_object_session_init, METH_VARARGS, "Prepare to bulk copy a specified table"},
-    {"send", (PYFUNCTION_CAST)python_bcp_object_sendrow, METH_VARARGS|METH_KEYWORDS, "Commit transaction of rowcount sent and terminate bulk operation"},
+    {"send", (PyCFunction)(void(*)(void))python_bcp_object_sendrow, FASTCALL_FLAGS, "Send a row, given as a list or tuple of column values"},
+    {"writer", (PYFUNCTION_CAST)python_bcp_object_writer, METH_NOARGS, "Create a RowWriter for the active bcp session"},
     {"commit", (PYFUNCTION_CAST)python_bcp_object_done, METH_VARARGS, "Commit transaction of rowcount sent and terminate bulk operation"},
     {"done", (PYFUNCTION_CAST)python_bcp_object_done, METH_VARARGS, "Commit transaction of rowcount sent and terminate bulk operation"},
     {"simplequery", (PYFUNCTION_CAST)python_bcp_object_simple_query, METH_VARARGS|METH_KEYWORDS, "(DEBUG_ONLY) Test connection with a simple query"},
     {"control", (PYFUNCTION_CAST)python_bcp_object_session_control, METH_VARARGS, "Change control parameters for bcp session"},
+    {"streaming", (PYFUNCTION_CAST)python_bcp_object_streaming, METH_VARARGS|METH_KEYWORDS, "Commit on row count, byte count or latency, whichever comes first"},
+    {"cache", (PYFUNCTION_CAST)python_bcp_object_cache, METH_VARARGS|METH_KEYWORDS, "Cache encoded values for low cardinality string columns"},
+    {"stats", (PYFUNCTION_CAST)python_bcp_object_stats, METH_NOARGS, "Transfer counters and cache hit rates"},
+    {"callmany", (PYFUNCTION_CAST)python_bcp_object_callmany, METH_VARARGS|METH_KEYWORDS, "Call a stored procedure once per parameter row, batching the round trips as language batches; outputs is a list of output parameters or a dict of their SQL types; returns (statuses, outputs, errors)"},
     {NULL}        /* Sentinel */
 };
 
@@ -739,6 +4434,13 @@ static PyMemberDef python_bcp_object_members[] =
     {"rowcount", T_UINT, offsetof(BCP_ConnectionObject, rowcount), READONLY, "rows written so far"},
     {"batchsize", T_UINT, offsetof(BCP_ConnectionObject, batchsize), WRITE_RESTRICTED, "number of rows to write before a commit"},
     {"textsize", T_UINT, offsetof(BCP_ConnectionObject, textsize), WRITE_RESTRICTED, "maximum size of column data"},
+    {"batchbytes", T_PYSSIZET, offsetof(BCP_ConnectionObject, batchbytes), READONLY, "streaming mode: bytes of pending column data that trigger a commit"},
+    {"maxlatency", T_DOUBLE, offsetof(BCP_ConnectionObject, maxlatency), READONLY, "streaming mode: seconds a row may wait before it is committed"},
+    {"batches", T_PYSSIZET, offsetof(BCP_ConnectionObject, batches), READONLY, "number of bcp_batch() commits made"},
+    {"packetsize", T_INT, offsetof(BCP_ConnectionObject, packetsize), READONLY, "TDS packet size negotiated with the server"},
+    {"nodelay", T_INT, offsetof(BCP_ConnectionObject, nodelay), READONLY, "TCP_NODELAY setting of the connection socket"},
+    {"sndbufrequest", T_INT, offsetof(BCP_ConnectionObject, sndbufrequest), READONLY, "socket send buffer size requested by the last connect(), 0 if none"},
+    {"sndbuf", T_INT, offsetof(BCP_ConnectionObject, sndbuf), READONLY, "socket send buffer size granted by the operating system"},
     {NULL}        /* Sentinel */
 };
 
@@ -786,6 +4488,127 @@ static PyTypeObject BCP_ConnectionType = {
     python_bcp_object_new,     /* tp_new */
 };
 
+//=================================================================================
+//                   Method declaration table for the row writer
+//=================================================================================
+static PyMethodDef python_bcp_rowwriter_methods[] = {
+    {"write", (PyCFunction)(void(*)(void))python_bcp_rowwriter_write, FASTCALL_FLAGS, "Send a row given as positional column values"},
+    {"writerow", (PyCFunction)python_bcp_rowwriter_writerow, METH_O, "Send a row given as a list or tuple of column values"},
+    {NULL}        /* Sentinel */
+};
+
+static PyMemberDef python_bcp_rowwriter_members[] =
+{
+    {"connection", T_OBJECT, offsetof(BCP_RowWriterObject, connection), READONLY, "connection the writer sends rows through"},
+    {NULL}        /* Sentinel */
+};
+
+#ifdef HAVE_VECTORCALL
+#   define ROWWRITER_VECTORCALL_OFFSET offsetof(BCP_RowWriterObject, vectorcall)
+#   define ROWWRITER_CALL PyVectorcall_Call
+#   define ROWWRITER_FLAGS Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL
+#else
+#   define ROWWRITER_VECTORCALL_OFFSET 0
+#   define ROWWRITER_CALL (ternaryfunc)python_bcp_rowwriter_call
+#   define ROWWRITER_FLAGS Py_TPFLAGS_DEFAULT
+#endif
+
+//=================================================================================
+//               Type definition structure for the row writer object
+//=================================================================================
+static PyTypeObject BCP_RowWriterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "bcp.RowWriter",           /*tp_name*/
+    sizeof(BCP_RowWriterObject), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)python_bcp_rowwriter_delete, /*tp_dealloc*/
+    ROWWRITER_VECTORCALL_OFFSET, /*tp_print, tp_vectorcall_offset from 3.8*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    ROWWRITER_CALL,            /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    ROWWRITER_FLAGS,           /*tp_flags*/
+    "BCP RowWriter object, call it or its write() method with one value per column", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    python_bcp_rowwriter_methods, /* tp_methods */
+    python_bcp_rowwriter_members, /* tp_members */
+};
+
+//=================================================================================
+//              Method declaration table for the partitioned loader
+//=================================================================================
+static PyMethodDef python_bcp_loader_methods[] = {
+    {"send", (PyCFunction)(void(*)(void))python_bcp_loader_send, FASTCALL_FLAGS, "Route a row, given as a list or tuple of column values, to its partition's staging load"},
+    {"done", (PYFUNCTION_CAST)python_bcp_loader_done, METH_NOARGS, "Finish the staging loads and switch them into the table"},
+    {NULL}        /* Sentinel */
+};
+
+static PyMemberDef python_bcp_loader_members[] =
+{
+    {"rowcount", T_PYSSIZET, offsetof(BCP_PartitionedLoaderObject, rowcount), READONLY, "rows routed so far"},
+    {"partitions", T_INT, offsetof(BCP_PartitionedLoaderObject, partitions), READONLY, "number of partitions of the table"},
+    {"connection", T_OBJECT, offsetof(BCP_PartitionedLoaderObject, control), READONLY, "connection used for the catalog and the partition switches"},
+    {NULL}        /* Sentinel */
+};
+
+//=================================================================================
+//            Type definition structure for the partitioned loader object
+//=================================================================================
+static PyTypeObject BCP_PartitionedLoaderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "bcp.PartitionedLoader",   /*tp_name*/
+    sizeof(BCP_PartitionedLoaderObject), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)python_bcp_loader_delete, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "BCP PartitionedLoader object, loads each partition of a table through its own staging table", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    0,                         /* tp_richcompare */
+    0,                         /* tp_weaklistoffset */
+    0,                         /* tp_iter */
+    0,                         /* tp_iternext */
+    python_bcp_loader_methods, /* tp_methods */
+    python_bcp_loader_members, /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)python_bcp_loader_init,      /* tp_init */
+    0,                         /* tp_alloc */
+    python_bcp_loader_new,     /* tp_new */
+};
+
 //=================================================================================
 //               Python 3 requires new initialization pattern
 //=================================================================================
@@ -830,6 +4653,16 @@ initbcp(void)
         INIT_ERROR();
     }
 
+    if (PyType_Ready(&BCP_RowWriterType) < 0)
+    {
+        INIT_ERROR();
+    }
+
+    if (PyType_Ready(&BCP_PartitionedLoaderType) < 0)
+    {
+        INIT_ERROR();
+    }
+
     if ((module = CREATE_MODULE()) == NULL)
     {
         INIT_ERROR();
@@ -838,6 +4671,10 @@ initbcp(void)
     declare_exceptions(module);
     Py_INCREF(&BCP_ConnectionType);
     PyModule_AddObject(module, "Connection", (PyObject*) &BCP_ConnectionType);
+    Py_INCREF(&BCP_RowWriterType);
+    PyModule_AddObject(module, "RowWriter", (PyObject*) &BCP_RowWriterType);
+    Py_INCREF(&BCP_PartitionedLoaderType);
+    PyModule_AddObject(module, "PartitionedLoader", (PyObject*) &BCP_PartitionedLoaderType);
 
     INIT_SUCCESS();
 }
@@ -108,7 +108,7 @@ if ON_WINDOWS:
         sources = ['pythonbcp.c'],
         include_dirs = include_dirs,
         library_dirs = lib_dirs,
-        libraries = ['sybdb'],
+        libraries = ['sybdb', 'ws2_32'],
     )
 
     setup(
@@ -126,6 +126,7 @@ else:
         include_dirs = include_dirs,
         library_dirs = lib_dirs,
         libraries = ['sybdb',
+                     'pthread',
                      # 'iconv', # not needed on ubuntu
                      ],
         # extra_compile_args=['-m32', '-march=i386'],